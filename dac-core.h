@@ -0,0 +1,635 @@
+/*
+ * DAC sample generation: wavetable voices, the mixer, the note sequencer,
+ * command batches, the clip bank and the PCM rate converter. It does not
+ * depend on the kernel, so the host simulation in sim/ builds the same
+ * code. Nothing here locks or allocates, callers hold the DAC lock.
+ */
+
+#ifndef DAC_CORE_H
+#define DAC_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <asm/errno.h>
+#else
+#include "kcompat.h"
+#endif
+
+#include "hal.h"
+#include "offsets.h"
+#include "driver-gamepad.h"
+#include "wavetable.h"
+
+/* Fixed rate used for synthesized tones */
+#define DAC_SYNTH_RATE DAC_TONE_RATE // Tone sample rate in Hz
+
+/* Wavetables indexed by DAC_WAVE_*, defined once by the driver or sim/driver.c */
+extern int16_t dac_wavetables[DAC_WAVE_COUNT][WAVETABLE_SIZE];
+
+/* Phase increment for each MIDI note, defined next to the wavetables */
+extern uint32_t dac_note_steps[128];
+
+/* Synthesizer voice */
+struct dac_voice {
+	uint32_t phase; // Position in the waveform period, a full turn is 2^32
+	uint32_t step; // Phase increment per sample, sets the frequency
+	const int16_t *wavetable; // Waveform being played
+	int32_t volume; // Peak-to-peak level in DAC steps
+	uint32_t left; // Samples until a timed voice stops
+};
+
+/* Tone synthesizer, mixes the active voices around the middle of the DAC range */
+#define DAC_MIDPOINT 2048
+
+/* Voice playing a cached clip */
+struct dac_clip_voice {
+	const int16_t *samples; // Samples of the clip, owned by the bank
+	uint32_t pos; // Next sample to play
+	uint32_t count; // Number of samples
+	int32_t volume; // Peak-to-peak level in DAC steps
+};
+
+struct dac_synth {
+	struct dac_voice voices[DAC_VOICES];
+	uint32_t active; // Bit mask of voices that are playing
+	uint32_t timed; // Bit mask of voices that stop once their samples left run out
+	struct dac_clip_voice clips[DAC_CLIP_VOICES];
+	uint32_t clips_active; // Bit mask of clip voices that are playing
+};
+
+/* Bank of uploaded clips, the samples are allocated and freed by the caller */
+struct dac_clip {
+	int16_t *samples; // NULL while the slot is free
+	uint32_t count; // Number of samples
+	uint32_t last_play; // Bank play count when last played, the lowest is evicted first
+	uint8_t gen; // Bumped on each load so ids of evicted clips go stale
+	char name[DAC_CLIP_NAME_LEN];
+};
+
+struct dac_clip_bank {
+	struct dac_clip clips[DAC_CLIP_MAX];
+	uint32_t count; // Loaded clips
+	uint32_t bytes; // Memory used by samples
+	uint32_t bytes_max; // Most memory samples may use
+	uint32_t evictions; // Clips evicted to make room
+	uint32_t plays; // Clips started
+};
+
+/* Note sequencer, steps through a score once per sample */
+#define DAC_SEQ_EVENTS_PER_SAMPLE 16 // Most events applied in one sample period
+
+struct dac_seq {
+	struct dac_seq_event *events; // Score, replaced as a whole
+	unsigned int count; // Number of events
+	unsigned int loop; // Event to continue from after the last one
+	unsigned int next; // Next event to apply
+	uint32_t wait; // Samples left before the next event
+	uint32_t loops; // Times the score has looped
+	uint32_t samples; // Samples played since the score was written
+	bool playing; // Score is playing
+};
+
+/* Phase increment per sample for a frequency in millihertz */
+static inline uint32_t dac_freq_step(uint32_t millihertz) {
+	return div_u64((uint64_t)millihertz << 32, DAC_SYNTH_RATE * 1000);
+}
+
+/* Fill the generated wavetables, the sine table is precomputed */
+static inline void dac_init_wavetables(void) {
+	int i;
+
+	for (i = 0; i < WAVETABLE_SIZE; i++) {
+		dac_wavetables[DAC_WAVE_SINE][i] = wavetable_sine[i];
+		dac_wavetables[DAC_WAVE_SQUARE][i] = i < WAVETABLE_SIZE / 2 ? 32767 : -32768;
+		dac_wavetables[DAC_WAVE_TRIANGLE][i] = i < WAVETABLE_SIZE / 2 ?
+				-32768 + i * 512 : 32767 - (i - WAVETABLE_SIZE / 2) * 512;
+		dac_wavetables[DAC_WAVE_SAW][i] = -32768 + i * 256;
+	}
+}
+
+/* Fill the phase increments of all MIDI notes */
+static inline void dac_init_notes(void) {
+	/* Frequencies of the lowest octave, C-1 to B-1, in microhertz */
+	static const uint32_t octave[12] = {
+		8175799, 8661957, 9177024, 9722718, 10300861, 10913382,
+		11562326, 12249857, 12978272, 13750000, 14567618, 15433853
+	};
+	uint64_t step;
+	int note;
+
+	for (note = 0; note < 128; note++) {
+		/* Step is f / rate * 2^32, both sides divided by 64 to keep the divisor in 32 bits */
+		step = div_u64((uint64_t)octave[note % 12] << 26, (DAC_SYNTH_RATE * 1000000ULL) >> 6);
+		step <<= note / 12;
+
+		/* Notes above half the sample rate are left silent */
+		dac_note_steps[note] = step < (1ULL << 31) ? step : 0;
+	}
+}
+
+/* Set voice frequency in millihertz, 0 stops it */
+static inline void dac_voice_set_freq(struct dac_synth *synth, int voice, uint32_t millihertz) {
+	/* The phase is kept to avoid clicks */
+	synth->voices[voice].step = dac_freq_step(millihertz);
+	synth->timed &= ~(1 << voice);
+	if (millihertz != 0) {
+		synth->active |= 1 << voice;
+	} else {
+		synth->active &= ~(1 << voice);
+	}
+}
+
+/* Saturate a mixed sum of voices to the DAC range */
+static inline uint32_t dac_synth_clamp(int32_t sum) {
+	int32_t sample = DAC_MIDPOINT + (sum >> 16);
+
+	if (sample < 0) return 0;
+	if (sample > 0xfff) return 0xfff;
+	return sample;
+}
+
+/* Sum one sample of the active voices */
+static inline int32_t dac_synth_sum(struct dac_voice *voices, uint32_t active) {
+	struct dac_voice *voice;
+	int32_t sum = 0;
+
+	/* Only visit active voices, at most DAC_VOICES */
+	while (active != 0) {
+		voice = &voices[__ffs(active)];
+		active &= active - 1;
+
+		sum += voice->wavetable[voice->phase >> 24] * voice->volume;
+		voice->phase += voice->step;
+	}
+
+	return sum;
+}
+
+/* Mix one sample of the active voices, saturated to the DAC range */
+static inline uint32_t dac_synth_mix(struct dac_voice *voices, uint32_t active) {
+	return dac_synth_clamp(dac_synth_sum(voices, active));
+}
+
+/* Sum one sample of the playing clips, clip voices stop at the end of their clip */
+static inline int32_t dac_clip_sum(struct dac_synth *synth) {
+	uint32_t active = synth->clips_active;
+	struct dac_clip_voice *clip;
+	int32_t sum = 0;
+	int voice;
+
+	while (active != 0) {
+		voice = __ffs(active);
+		active &= active - 1;
+
+		clip = &synth->clips[voice];
+		sum += clip->samples[clip->pos] * clip->volume;
+		if (++clip->pos == clip->count) synth->clips_active &= ~(1 << voice);
+	}
+
+	return sum;
+}
+
+/* Clip id of a bank slot */
+static inline uint16_t dac_clip_id(const struct dac_clip_bank *bank, int slot) {
+	return (bank->clips[slot].gen << 8) | slot;
+}
+
+/* Find a loaded clip by id, returns NULL for stale or unknown ids */
+static inline struct dac_clip *dac_clip_lookup(struct dac_clip_bank *bank, uint16_t id) {
+	int slot = id & 0xff;
+
+	if (slot >= DAC_CLIP_MAX || bank->clips[slot].samples == NULL) return NULL;
+	if (dac_clip_id(bank, slot) != id) return NULL;
+
+	return &bank->clips[slot];
+}
+
+/* Find a loaded clip by name, returns its slot or -1 */
+static inline int dac_clip_find(const struct dac_clip_bank *bank, const char *name) {
+	int slot;
+
+	for (slot = 0; slot < DAC_CLIP_MAX; slot++) {
+		if (bank->clips[slot].samples != NULL &&
+				strncmp(bank->clips[slot].name, name, DAC_CLIP_NAME_LEN) == 0) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+/* Find a free slot, returns -1 if the bank is full */
+static inline int dac_clip_free_slot(const struct dac_clip_bank *bank) {
+	int slot;
+
+	for (slot = 0; slot < DAC_CLIP_MAX; slot++) {
+		if (bank->clips[slot].samples == NULL) return slot;
+	}
+
+	return -1;
+}
+
+/* Find the least recently played clip, returns -1 if the bank is empty */
+static inline int dac_clip_victim(const struct dac_clip_bank *bank) {
+	int slot, victim = -1;
+
+	for (slot = 0; slot < DAC_CLIP_MAX; slot++) {
+		if (bank->clips[slot].samples == NULL) continue;
+		if (victim < 0 || (int32_t)(bank->clips[slot].last_play - bank->clips[victim].last_play) < 0) {
+			victim = slot;
+		}
+	}
+
+	return victim;
+}
+
+/* Put samples into a free slot, returns the clip id */
+static inline uint16_t dac_clip_insert(struct dac_clip_bank *bank, int slot, const char *name,
+		int16_t *samples, uint32_t count) {
+	struct dac_clip *clip = &bank->clips[slot];
+
+	clip->samples = samples;
+	clip->count = count;
+	clip->last_play = bank->plays;
+	clip->gen++;
+	strncpy(clip->name, name, DAC_CLIP_NAME_LEN);
+	bank->count++;
+	bank->bytes += count * sizeof(int16_t);
+
+	return dac_clip_id(bank, slot);
+}
+
+/* Stop the clip voices of a synthesizer that play the given samples */
+static inline void dac_clip_stop(struct dac_synth *synth, const int16_t *samples) {
+	int voice;
+
+	for (voice = 0; voice < DAC_CLIP_VOICES; voice++) {
+		if (synth->clips[voice].samples == samples) {
+			synth->clips_active &= ~(1 << voice);
+			synth->clips[voice].samples = NULL;
+		}
+	}
+}
+
+/* Take a clip out of the bank and stop the voices playing it, returns the samples to free */
+static inline int16_t *dac_clip_remove(struct dac_clip_bank *bank, struct dac_synth *synth, int slot) {
+	struct dac_clip *clip = &bank->clips[slot];
+	int16_t *samples = clip->samples;
+
+	dac_clip_stop(synth, samples);
+
+	clip->samples = NULL;
+	bank->count--;
+	bank->bytes -= clip->count * sizeof(int16_t);
+
+	return samples;
+}
+
+/* Start a clip on a clip voice from its first sample, volume 0 stops the voice */
+static inline int dac_clip_play(struct dac_clip_bank *bank, struct dac_synth *synth,
+		uint16_t id, uint8_t voice, uint16_t volume) {
+	struct dac_clip *clip;
+
+	if (voice >= DAC_CLIP_VOICES || volume > 0xfff) return -EINVAL;
+
+	if (volume == 0) {
+		synth->clips_active &= ~(1 << voice);
+		return 0;
+	}
+
+	clip = dac_clip_lookup(bank, id);
+	if (clip == NULL) return -ENOENT;
+
+	synth->clips[voice].samples = clip->samples;
+	synth->clips[voice].pos = 0;
+	synth->clips[voice].count = clip->count;
+	synth->clips[voice].volume = volume;
+	synth->clips_active |= 1 << voice;
+	clip->last_play = ++bank->plays;
+
+	return 0;
+}
+
+/* Apply one score event to its voice */
+static inline void dac_seq_apply(struct dac_synth *synth, const struct dac_seq_event *event) {
+	struct dac_voice *voice = &synth->voices[event->voice];
+	uint32_t step = event->note != 0 ? dac_note_steps[event->note] : 0;
+
+	voice->step = step;
+	voice->wavetable = dac_wavetables[event->waveform];
+	voice->volume = (event->volume << 4) | (event->volume >> 4);
+	if (step != 0) {
+		synth->active |= 1 << event->voice;
+	} else {
+		synth->active &= ~(1 << event->voice);
+	}
+}
+
+/* Advance the score by one sample, returns false once the score has ended */
+static inline bool dac_seq_tick(struct dac_seq *seq, struct dac_synth *synth) {
+	unsigned int budget = DAC_SEQ_EVENTS_PER_SAMPLE;
+
+	seq->samples++;
+
+	/* Apply the events that are due, a loop without delays is spread over samples */
+	while (seq->wait == 0 && budget-- > 0) {
+		dac_seq_apply(synth, &seq->events[seq->next]);
+
+		if (++seq->next == seq->count) {
+			if (seq->loop >= seq->count) {
+				seq->playing = false;
+				return false;
+			}
+			seq->next = seq->loop;
+			seq->loops++;
+		}
+		seq->wait = seq->events[seq->next].delay;
+	}
+
+	if (seq->wait > 0) seq->wait--;
+
+	return true;
+}
+
+/* Replace the score and start playing it, events may be NULL to stop, returns the old score */
+static inline struct dac_seq_event *dac_seq_swap(struct dac_seq *seq, struct dac_seq_event *events,
+		unsigned int count, unsigned int loop) {
+	struct dac_seq_event *old = seq->events;
+
+	seq->events = events;
+	seq->count = count;
+	seq->loop = loop;
+	seq->next = 0;
+	seq->wait = count > 0 ? events[0].delay : 0;
+	seq->loops = 0;
+	seq->samples = 0;
+	seq->playing = count > 0;
+
+	return old;
+}
+
+/* Check the events of a score */
+static inline int dac_seq_check(const struct dac_seq_event *events, unsigned int count) {
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (events[i].voice >= DAC_VOICES || events[i].note >= 128 ||
+				events[i].waveform >= DAC_WAVE_COUNT) {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* Check one command of a batch */
+static inline int dac_cmd_check(const struct dac_cmd *cmd) {
+	if (cmd->voice >= DAC_VOICES || cmd->reserved != 0) return -EINVAL;
+
+	switch (cmd->op) {
+	case DAC_CMD_SET_FREQ:
+		return cmd->value <= DAC_SYNTH_RATE * 1000 / 2 ? 0 : -EINVAL;
+	case DAC_CMD_SET_AMPLITUDE:
+		return cmd->value <= 0xfff ? 0 : -EINVAL;
+	case DAC_CMD_SET_WAVEFORM:
+		return cmd->value < DAC_WAVE_COUNT ? 0 : -EINVAL;
+	case DAC_CMD_START:
+	case DAC_CMD_STOP:
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* Apply one checked command */
+static inline void dac_cmd_apply(struct dac_synth *synth, const struct dac_cmd *cmd) {
+	struct dac_voice *voice = &synth->voices[cmd->voice];
+
+	switch (cmd->op) {
+	case DAC_CMD_SET_FREQ:
+		dac_voice_set_freq(synth, cmd->voice, cmd->value);
+		break;
+	case DAC_CMD_SET_AMPLITUDE:
+		voice->volume = cmd->value;
+		break;
+	case DAC_CMD_SET_WAVEFORM:
+		voice->wavetable = dac_wavetables[cmd->value];
+		break;
+	case DAC_CMD_START:
+		if (voice->step != 0) synth->active |= 1 << cmd->voice;
+		break;
+	case DAC_CMD_STOP:
+		synth->active &= ~(1 << cmd->voice);
+		synth->timed &= ~(1 << cmd->voice);
+		break;
+	}
+}
+
+/* Check a button binding, clip ids are looked up when it fires */
+static inline int dac_binding_check(const struct dac_binding *bind) {
+	if (bind->reserved != 0 || bind->volume > 0xfff) return -EINVAL;
+
+	switch (bind->type) {
+	case DAC_BIND_NONE:
+		return 0;
+	case DAC_BIND_TONE:
+		if (bind->waveform >= DAC_WAVE_COUNT || bind->value > DAC_SYNTH_RATE * 1000 / 2) return -EINVAL;
+		/* Fall through */
+	case DAC_BIND_STOP:
+		return bind->voice < DAC_VOICES ? 0 : -EINVAL;
+	case DAC_BIND_CLIP:
+		return bind->voice < DAC_CLIP_VOICES && bind->value <= 0xffff ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+/* Start the sound of a checked binding, a stale clip id plays nothing */
+static inline void dac_binding_apply(struct dac_synth *synth, struct dac_clip_bank *bank,
+		const struct dac_binding *bind) {
+	uint32_t samples = bind->duration_ms * DAC_SYNTH_RATE / 1000;
+	struct dac_voice *voice = &synth->voices[bind->voice];
+
+	switch (bind->type) {
+	case DAC_BIND_TONE:
+		voice->wavetable = dac_wavetables[bind->waveform];
+		voice->volume = bind->volume;
+		dac_voice_set_freq(synth, bind->voice, bind->value);
+		if (samples != 0 && bind->value != 0) {
+			voice->left = samples;
+			synth->timed |= 1 << bind->voice;
+		}
+		break;
+	case DAC_BIND_CLIP:
+		if (dac_clip_play(bank, synth, bind->value, bind->voice, bind->volume) == 0 &&
+				samples != 0 && samples < synth->clips[bind->voice].count) {
+			synth->clips[bind->voice].count = samples;
+		}
+		break;
+	case DAC_BIND_STOP:
+		synth->active &= ~(1 << bind->voice);
+		synth->timed &= ~(1 << bind->voice);
+		break;
+	}
+}
+
+/* Count down timed voices by one sample, stopping the ones that run out */
+static inline void dac_synth_countdown(struct dac_synth *synth) {
+	uint32_t timed = synth->timed;
+	int voice;
+
+	while (timed != 0) {
+		voice = __ffs(timed);
+		timed &= timed - 1;
+
+		if (--synth->voices[voice].left == 0) {
+			synth->active &= ~(1 << voice);
+			synth->timed &= ~(1 << voice);
+		}
+	}
+}
+
+/* Check if anything is left to play in tone and sequencer mode */
+static inline bool dac_core_playing(const struct dac_seq *seq, const struct dac_synth *synth) {
+	return synth->active != 0 || synth->clips_active != 0 || seq->playing;
+}
+
+/*
+ * Produce the next tone sample, clears playing in seq when its score ends and
+ * the bits of timed voices and clip voices that run out
+ */
+static inline uint32_t dac_core_render(struct dac_seq *seq, struct dac_synth *synth) {
+	int32_t sum;
+
+	if (seq->playing) dac_seq_tick(seq, synth);
+
+	sum = dac_synth_sum(synth->voices, synth->active);
+	if (synth->clips_active != 0) sum += dac_clip_sum(synth);
+	if (synth->timed != 0) dac_synth_countdown(synth);
+
+	return dac_synth_clamp(sum);
+}
+
+/* Default number of tone samples rendered ahead at a time */
+#define DAC_RENDER_BLOCK 64
+
+/* Render tone samples into a ring of frames in OFF_DAC0_COMBDATA layout, starting at head */
+static inline void dac_core_render_block(struct dac_seq *seq, struct dac_synth *synth,
+		uint32_t *frames, unsigned int mask, unsigned int head, unsigned int num) {
+	uint32_t sample;
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		sample = dac_core_render(seq, synth);
+		frames[(head + i) & mask] = sample | (sample << 16);
+	}
+}
+
+/*
+ * PCM sample-rate converter. Written frames at any rate from
+ * DAC_RESAMPLE_RATE_MIN to DAC_RESAMPLE_RATE_MAX are interpolated to
+ * DAC_SYNTH_RATE with a Catmull-Rom cubic through the last four input frames,
+ * so the sample timer keeps the same period in every mode. The position
+ * between the middle two frames is counted in steps of 1/DAC_SYNTH_RATE frame
+ * and each output frame advances it by the input rate, so the ratio is exact
+ * and the stream never drifts.
+ */
+#define DAC_RESAMPLE_RATE_MIN 1000
+#define DAC_RESAMPLE_RATE_MAX 48000
+#define DAC_RESAMPLE_SHIFT 12 // Interpolation position bits
+
+/* Turns a position into a fraction with a multiply, position * RECIP >> 16 */
+#define DAC_RESAMPLE_RECIP (((1 << (16 + DAC_RESAMPLE_SHIFT)) + DAC_SYNTH_RATE / 2) / DAC_SYNTH_RATE)
+
+struct dac_resampler {
+	uint32_t rate; // Input rate in Hz
+	uint32_t pos; // Output position past hist[1], in 1/DAC_SYNTH_RATE input frames
+	int32_t hist[2][4]; // Last four input frames of each channel around the midpoint, oldest first
+};
+
+/* Start converting from rate, the stream begins at the DAC midpoint */
+static inline void dac_resample_init(struct dac_resampler *rs, uint32_t rate) {
+	memset(rs, 0, sizeof(*rs));
+	rs->rate = rate;
+}
+
+/* Most output frames a single input frame can produce */
+static inline unsigned int dac_resample_max_out(const struct dac_resampler *rs) {
+	return (DAC_SYNTH_RATE + rs->rate - 1) / rs->rate;
+}
+
+/* Interpolate between p[1] and p[2] at fraction t, saturated to the DAC range */
+static inline uint32_t dac_resample_cubic(const int32_t *p, int32_t t) {
+	int32_t a = 3 * (p[1] - p[2]) + p[3] - p[0];
+	int32_t b = 2 * p[0] - 5 * p[1] + 4 * p[2] - p[3];
+	int32_t c = p[2] - p[0];
+	int32_t sample;
+
+	/* p1 + t / 2 * (c + t * (b + t * a)), the halving folded into the last shift */
+	sample = c + ((t * (b + ((t * a) >> DAC_RESAMPLE_SHIFT))) >> DAC_RESAMPLE_SHIFT);
+	sample = DAC_MIDPOINT + p[1] + ((t * sample + (1 << DAC_RESAMPLE_SHIFT)) >> (DAC_RESAMPLE_SHIFT + 1));
+
+	if (sample < 0) return 0;
+	if (sample > 0xfff) return 0xfff;
+	return sample;
+}
+
+/*
+ * Feed one input frame of 12-bit samples and write the output frames that
+ * fall before it into a ring in OFF_DAC0_COMBDATA layout, starting at head.
+ * Output lags the input by two frames. Returns the number written, at most
+ * dac_resample_max_out().
+ */
+static inline unsigned int dac_resample_push(struct dac_resampler *rs, uint32_t left, uint32_t right,
+		uint32_t *frames, unsigned int mask, unsigned int head) {
+	unsigned int num = 0;
+	int32_t t;
+	int ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		rs->hist[ch][0] = rs->hist[ch][1];
+		rs->hist[ch][1] = rs->hist[ch][2];
+		rs->hist[ch][2] = rs->hist[ch][3];
+	}
+	rs->hist[0][3] = (int32_t)left - DAC_MIDPOINT;
+	rs->hist[1][3] = (int32_t)right - DAC_MIDPOINT;
+
+	while (rs->pos < DAC_SYNTH_RATE) {
+		t = (rs->pos * DAC_RESAMPLE_RECIP) >> 16;
+		frames[(head + num) & mask] = dac_resample_cubic(rs->hist[0], t) |
+				(dac_resample_cubic(rs->hist[1], t) << 16);
+		num++;
+		rs->pos += rs->rate;
+	}
+	rs->pos -= DAC_SYNTH_RATE;
+
+	return num;
+}
+
+/*
+ * Mix the voices of a second synthesizer onto a frame rendered ahead, both
+ * channels, counting down its timed voices. Used for sounds that have to
+ * start on the next sample instead of the next block.
+ */
+static inline uint32_t dac_core_overlay(uint32_t frame, struct dac_synth *synth) {
+	int32_t sum = dac_synth_sum(synth->voices, synth->active);
+	uint32_t left, right;
+
+	if (synth->clips_active != 0) sum += dac_clip_sum(synth);
+	if (synth->timed != 0) dac_synth_countdown(synth);
+
+	left = dac_synth_clamp((((int32_t)(frame & 0xfff) - DAC_MIDPOINT) << 16) + sum);
+	right = dac_synth_clamp((((int32_t)((frame >> 16) & 0xfff) - DAC_MIDPOINT) << 16) + sum);
+
+	return left | (right << 16);
+}
+
+/* Write a sample to both channels of the DAC */
+static inline void dac_core_output(void *mem, uint32_t sample) {
+	hal_write(mem, OFF_DAC0_COMBDATA, sample | (sample << 16));
+}
+
+#endif // DAC_CORE_H
@@ -13,13 +13,35 @@
 #include <linux/sched.h>
 #include <linux/mutex.h>
 #include <linux/pid.h>
+#include <linux/cred.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/input.h>
+#include <linux/spinlock.h>
+#include <linux/dma-mapping.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/idr.h>
+#include <linux/kthread.h>
+#include <linux/kref.h>
 
-#include <asm/io.h>
 #include <asm/siginfo.h>
 #include <asm/errno.h>
 
 #include "offsets.h"
 #include "efm32gg.h"
+#include "driver-gamepad.h"
+#include "hal.h"
+#include "gamepad-core.h"
+#include "dac-core.h"
 
 /* Device name */
 #define DEVICE_NAME "tdt4258"
@@ -27,32 +49,194 @@
 #define CDEV_DAC "dac"
 
 /////////////////////////////////////////////////
-//                   GAMEPAD                   //
+//                CYCLE COUNTER                //
 /////////////////////////////////////////////////
 
-#define GAMEPAD_RESOURCE_NUM 0
+/* DWT registers of the Cortex-M3 */
+static void* cycles_mem;
+
+/* Enable the cycle counter */
+static int cycles_init(void) {
+	void *demcr = hal_map(DEMCR_BASE, 4);
+
+	if (demcr == NULL) return -ENOMEM; // Failed to map registers
+	hal_write(demcr, 0, hal_read(demcr, 0) | DEMCR_TRCENA); // Enable trace blocks
+	hal_unmap(demcr);
+
+	cycles_mem = hal_map(DWT_BASE, 8);
+	if (cycles_mem == NULL) return -ENOMEM; // Failed to map registers
+	hal_write(cycles_mem, OFF_DWT_CTRL, hal_read(cycles_mem, OFF_DWT_CTRL) | 1); // Start counter
+
+	return 0;
+}
+
+/* Read the cycle counter, wraps every 2^32 cycles */
+static inline uint32_t cycles_now(void) {
+	return hal_read(cycles_mem, OFF_DWT_CYCCNT);
+}
+
+/*
+ * Histogram of a measured quantity, cheap enough to update from interrupt
+ * handlers. Bucket n counts values from 2^(n-1) up to 2^n, the last bucket
+ * also counts everything above.
+ */
+#define STATS_BUCKETS 20
+
+struct stats_hist {
+	uint32_t count; // Number of values
+	uint32_t max; // Largest value
+	uint32_t buckets[STATS_BUCKETS];
+};
+
+/* Add a value to a histogram */
+static inline void stats_hist_add(struct stats_hist *hist, uint32_t value) {
+	hist->count++;
+	if (value > hist->max) hist->max = value;
+	hist->buckets[min(fls(value), STATS_BUCKETS - 1)]++;
+}
+
+/* Print a histogram as name_count, name_max and a line of bucket counts */
+static void stats_hist_show(struct seq_file *m, const char *name, const struct stats_hist *hist) {
+	int i;
+
+	seq_printf(m, "%s_count %u\n%s_max %u\n%s_hist", name, hist->count, name, hist->max, name);
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seq_printf(m, " %u", hist->buckets[i]);
+	}
+	seq_puts(m, "\n");
+}
 
-/* Device number used for gamepad */
-static dev_t gamepad_dev;
 
-/* cdev struct */
-static struct cdev gamepad_cdev;
+/////////////////////////////////////////////////
+//                   GAMEPAD                   //
+/////////////////////////////////////////////////
 
-/* Class struct */
+#define GAMEPAD_RESOURCE_NUM 0
+
+/* Class struct, shared by the gamepads of all devices */
 static struct class *gamepad_cl;
+static dev_t gamepad_devt; // First of the device numbers reserved for gamepads
 
-/* Platfom information */
-static struct resource *gamepad_res;
-static void* gamepad_mem;
-static int gamepad_irq_even;
-static int gamepad_irq_odd;
+/* Default key of each button, copied to each input device */
+static const unsigned short gamepad_keymap[8] = {
+	KEY_LEFT, KEY_UP, KEY_RIGHT, KEY_DOWN, // Left button cluster, SW1-SW4
+	BTN_Y, BTN_X, BTN_B, BTN_A // Right button cluster, SW5-SW8
+};
 
-/* Last read input */
-static uint8_t gamepad_input;
+/* Pin samples latched by the interrupt handler for the tasklet */
+#define GAMEPAD_LATCH_SIZE 32 // Number of samples, must be a power of two
+
+/* Gamepad of one device */
+struct tdt4258_gamepad {
+	/* Device number, cdev and class device */
+	dev_t dev;
+	struct cdev cdev;
+	struct device *device;
+	char name[16]; // Node name, also used for the interrupts
+
+	/* Platfom information */
+	struct resource *res;
+	void* mem;
+	int irq_even;
+	int irq_odd;
+
+	/* Delivered input, debouncer and event ring */
+	struct gamepad_core core;
+
+	/* Input device, reports the buttons as keys */
+	struct input_dev *idev;
+	unsigned short keymap[8];
+	char phys[32];
+
+	/* Pin samples latched by the interrupt handler for the tasklet */
+	struct {
+		struct {
+			ktime_t time; // Time of interrupt
+			uint8_t din; // Pin levels
+			uint8_t flags; // Pins that caused the interrupt
+		} samples[GAMEPAD_LATCH_SIZE];
+		unsigned int head; // Next sample to write, only written by the interrupt handler
+		unsigned int tail; // Next sample to process, only written by the tasklet
+	} latch;
+	struct tasklet_struct tasklet;
+	bool stopping; // Set on removal, the tasklet then returns without arming timers
+	bool dead; // Set on removal, file operations then fail with -ENODEV
+
+	/* Time spent in interrupt handler and tasklet */
+	struct {
+		uint32_t top_count; // Number of interrupts
+		uint64_t top_ns; // Total time in interrupt handler
+		uint32_t top_max_ns; // Longest interrupt handler run
+		uint32_t bottom_count; // Number of tasklet runs
+		uint64_t bottom_ns; // Total time in tasklet
+		uint32_t bottom_max_ns; // Longest tasklet run
+		uint32_t latch_overruns; // Samples lost because the tasklet fell behind
+		uint32_t latency_max_ns; // Longest time from interrupt to delivery of a sample
+	} stats;
+
+	/* Statistics exported in debugfs */
+	struct {
+		struct stats_hist irq_cycles; // Interrupt handler run time
+		struct stats_hist delivery_ns; // Time from interrupt until an event is read
+		uint32_t dropped; // Events lost by readers that fell behind
+		uint32_t signals; // Realtime signals sent
+		uint32_t signals_coalesced; // Input changes folded into a later signal
+		uint32_t signals_lost; // Signals not queued because the process had too many pending
+	} debug;
+	spinlock_t debug_lock; // Guards dropped and delivery_ns, updated by concurrent readers
+
+	/* Debounce timer, fires at the end of the earliest window */
+	struct hrtimer debounce_timer;
+
+	/* Sampling timer, runs instead of the pin interrupts while polling */
+	struct hrtimer poll_timer;
+
+	/* Readers waiting for events */
+	wait_queue_head_t wq;
+
+	/* Readers with gesture patterns, matched by the tasklet */
+	struct list_head gesture_readers;
+	spinlock_t gesture_lock; // Guards the list and the matchers on it
+	wait_queue_head_t gesture_wq; // Readers waiting for matches
+	struct hrtimer gesture_timer; // Fires when the earliest long press completes
+	unsigned int gesture_tail; // Next event in the ring to match
+	uint8_t gesture_state; // Button state after the events matched so far
+
+	/* Readers with realtime signals, coalesced and sent by the tasklet */
+	struct list_head notify_readers;
+	spinlock_t notify_lock; // Guards the list and the notifiers on it
+	struct hrtimer notify_timer; // Fires when the earliest coalesced signal is due
+
+	/* Page shared with userspace through mmap */
+	struct gamepad_shared *page;
+
+	/* Task struct of process to signal on interrupt */
+	struct task_struct* task;
+	struct mutex task_mutex; // Used to guard task struct pointer
+};
 
-/* Task struct of process to signal on interrupt */
-static struct task_struct* gamepad_task = NULL;
-static struct mutex gamepad_task_mutex; // Used to guard task struct pointer
+/* Per open file state */
+struct gamepad_reader {
+	struct tdt4258_gamepad *pad; // Gamepad the file was opened on
+	struct mutex lock; // Serializes reads on the file
+	struct gamepad_cursor cursor; // Position in the event ring
+	bool signalled; // This file owns the SIGUSR1 task slot
+	struct gamepad_event buff[GAMEPAD_RING_SIZE]; // Snapshot of records being read
+
+	/* Gesture patterns, reads return matches instead of events while set */
+	bool gestures; // Patterns are set and the file is on the matcher list
+	struct list_head gesture_node;
+	struct gamepad_matcher matcher;
+	struct gamepad_match matches[GAMEPAD_MATCH_RING_SIZE]; // Matches being read
+
+	/* Realtime signal with the input state, sent while the file is on the notify list */
+	bool notify; // Signals are on and the file is on the list
+	struct list_head notify_node;
+	struct gamepad_notifier notifier;
+	int notify_signo; // Signal to send
+	struct pid *notify_pid; // Thread group to signal, holds a reference
+	const struct cred *notify_cred; // Credentials of the process that asked, holds a reference
+};
 
 
 /////////////////////////////////////////////////
@@ -62,72 +246,393 @@ static struct mutex gamepad_task_mutex; // Used to guard task struct pointer
 #define DAC_RESOURCE_NUM 3
 #define DAC_TIMER_RESOURCE_NUM 1
 
-/* Device number used for dac */
-static dev_t dac_dev;
+/* Class struct, shared by the DACs of all devices */
+static struct class *dac_cl;
+static dev_t dac_devt; // First of the device numbers reserved for DACs
+
+/* Sample timer clock and the timer period for synthesized tones */
+#define DAC_TIMER_CLK (14000000/128) // Timer clock after prescale
+#define DAC_SYNTH_TOP (DAC_TIMER_CLK / DAC_SYNTH_RATE - 1) // Timer period for tones
+
+/* PCM sample ring buffer, filled by write and drained by the timer interrupt */
+#define DAC_PCM_RING_SIZE 2048 // Number of frames, must be a power of two
+
+/* Tones are rendered ahead into the PCM ring by a thread, a block at a time */
+#define DAC_RENDER_MIN 16 // Smallest block in samples
+#define DAC_RENDER_MAX 256 // Largest block in samples
+#define DAC_RENDER_CHUNK 32 // Samples rendered per hold of the synthesizer lock
+#define DAC_RENDER_PRIORITY 50 // SCHED_FIFO priority of the renderer thread
+
+/* DMA playback of PCM frames, paced by the sample timer through PRS */
+#define DAC_DMA_IRQ_NUM 3 // Platform interrupt of the DMA controller
+#define DAC_DMA_FRAMES 256 // Frames in each half of the ping-pong buffer
+#define DAC_DMA_ALT 16 // Index of the first alternate descriptor
+#define DAC_DMA_CTRL ((3 << 30) | (2 << 28) | (2 << 26) | (2 << 24) | \
+		((DAC_DMA_FRAMES - 1) << 4) | 3) // Fixed word dest, incrementing word source, ping-pong
+#define DAC_DMA_SOURCE (0x0a << 16) // DMA request from DAC0 channel 0
+#define DAC_DMA_PRS_SOURCE ((0x1d << 16) | 1) // PRS signal on TIMER1 overflow
+
+static bool use_dma = true;
+module_param(use_dma, bool, S_IRUGO);
+MODULE_PARM_DESC(use_dma, "Feed PCM samples to the DAC with DMA when the DMA interrupt is available");
+
+/* Memory of the clip bank of each DAC */
+static unsigned int clip_kb = 64;
+module_param(clip_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(clip_kb, "Size of the sound effect clip bank in KiB");
+
+/* Tables of the synthesizer, shared by all devices and filled in by each probe */
+int16_t dac_wavetables[DAC_WAVE_COUNT][WAVETABLE_SIZE];
+uint32_t dac_note_steps[128];
+
+/* Channel descriptor of the DMA controller */
+struct dac_dma_desc {
+	uint32_t src_end; // Address of the last source word
+	uint32_t dst_end; // Address of the last destination word
+	uint32_t ctrl; // Transfer configuration, the cycle bits are cleared when done
+	uint32_t user; // Unused
+};
 
-/* cdev struct */
-static struct cdev dac_cdev;
+/* DAC of one device */
+struct tdt4258_dac {
+	/* Device number, cdev and class device */
+	dev_t dev;
+	struct cdev cdev;
+	struct device *device;
+	char name[16]; // Node name, also used for the interrupts
+
+	/* Platfom information */
+	struct resource *res;
+	void* mem;
+
+	/* Tone synthesizer and the note sequencer stepping it from the timer interrupt */
+	struct dac_synth synth;
+	struct dac_seq seq;
+
+	/* Uploaded sound effect clips, played by clip voices of the synthesizer */
+	struct dac_clip_bank bank;
+
+	/* Sounds started by the gamepad tasklet on button edges, guarded by synth_lock */
+	struct dac_bindings bindings;
+
+	/* Voices started by bindings, mixed onto rendered frames in the timer interrupt, guarded by lock */
+	struct dac_synth bound;
+
+	/* Statistics exported in debugfs, the longest handler run bounds the extra delay of button interrupts */
+	struct {
+		struct stats_hist timer_cycles; // Timer interrupt handler run time
+		struct stats_hist dma_cycles; // DMA interrupt handler run time
+		struct stats_hist render_cycles; // Time to render one block
+		struct stats_hist render_fill; // Samples still queued when a block is rendered
+		uint32_t timer_overruns; // Timer periods that ended before the handler did
+		uint32_t render_underruns; // Samples missed because the renderer was late
+	} debug;
+
+	/* Playback information */
+	struct {
+		int mode; // DAC_MODE_* output mode
+		bool running; // Sample timer is running
+	} state;
+	bool dead; // Set on removal under mutex and lock, file operations then fail with -ENODEV
+	spinlock_t lock; // Guards starting and stopping playback
+	spinlock_t synth_lock; // Guards synthesizer, score, clip bank and bindings, taken before lock
+	struct mutex mutex; // Serializes writers and configuration changes
+
+	/* PCM sample ring buffer */
+	struct {
+		uint32_t *frames; // Samples for both channels in OFF_DAC0_COMBDATA layout
+		unsigned int head; // Next frame to write, only written by the writer
+		unsigned int tail; // Next frame to play, only written by the interrupt handler
+		uint32_t underruns; // Number of times playback ran out of frames
+		struct dac_pcm_format format; // Format of written samples
+		struct dac_resampler resampler; // Converts written frames to the tone rate
+	} pcm;
+	wait_queue_head_t wq; // Writers waiting for room in the ring
+
+	/* Renderer filling the PCM ring in tone and sequencer mode */
+	struct {
+		struct task_struct *thread;
+		wait_queue_head_t wq; // Renderer waits here for room for a block
+		unsigned int block; // Samples rendered at a time, up to two blocks are queued
+		bool idle; // Nothing to play, the interrupt stops playback once the ring drains
+	} render;
+
+	/* DAC sample timer */
+	struct resource *timer_res;
+	void* timer_mem;
+	int timer_irq;
+
+	/* DMA playback of PCM frames */
+	struct {
+		bool enabled; // DMA is used for PCM playback
+		bool active; // DMA is currently feeding the DAC
+		bool starved; // Last refill found no frames
+		int irq;
+		void *mem; // DMA controller registers
+		void *prs_mem; // PRS registers
+		struct dac_dma_desc *desc; // Descriptor block, primary followed by alternate
+		dma_addr_t desc_phys;
+		uint32_t *buff; // Both buffer halves
+		dma_addr_t buff_phys;
+		uint32_t last; // Last queued frame, repeated when the ring runs dry
+	} dma;
+};
 
-/* Class struct */
-static struct class *dac_cl;
 
-/* Platfom information */
-static struct resource *dac_res;
-static void* dac_mem;
+/////////////////////////////////////////////////
+//                   DEVICE                    //
+/////////////////////////////////////////////////
 
-/* Playback information */
-static struct {
-	bool high; // Should the output signal to the dac be high or low?
-	int amplitude; // The amplitude of the output signal
-} dac_state;
+/* Number of devices one kernel serves, each gets one gamepad and one DAC minor */
+#define TDT4258_MAX_DEVICES 8
 
-/* DAC sample timer */
-static struct resource *dac_timer_res;
-static void* dac_timer_mem;
-static int dac_timer_irq;
+/* State of one bound tdt4258 device */
+struct tdt4258 {
+	int id; // Instance number, also the minor of both character devices
+	struct tdt4258_gamepad gamepad;
+	struct tdt4258_dac dac;
+	struct dentry *debug_dir; // Statistics in debugfs
+	struct kref ref; // Held by the bound device and by each open file
+};
 
+/* Instance numbers in use */
+static DEFINE_IDA(tdt4258_ida);
 
+/* Devices that can be opened, by instance number */
+static struct tdt4258 *tdt4258_devices[TDT4258_MAX_DEVICES];
+static DEFINE_MUTEX(tdt4258_lock); // Guards the table
 
-/* User program opens the driver */
-static int gamepad_open(struct inode *inode, struct file *filp) {
-	/* Lock task mutex */
-	mutex_lock(&gamepad_task_mutex);
-	
-	if (gamepad_task == NULL) {
-		/* No other processes using gamepad, set task and unlock mutex */
-		gamepad_task = current;
-		mutex_unlock(&gamepad_task_mutex);
+/* Find the device of a node and take a reference for an open file, NULL once it is being removed */
+static struct tdt4258 *tdt4258_get(struct inode *inode, dev_t base) {
+	unsigned int id = iminor(inode) - MINOR(base);
+	struct tdt4258 *tdt = NULL;
 
-		printk("Opened by PID %i\n", current->pid);
-		return 0;
+	mutex_lock(&tdt4258_lock);
+	if (id < TDT4258_MAX_DEVICES && tdt4258_devices[id] != NULL) {
+		tdt = tdt4258_devices[id];
+		kref_get(&tdt->ref);
+	}
+	mutex_unlock(&tdt4258_lock);
+
+	return tdt;
+}
+
+/* Free the memory files may still use once the last reference is gone, defined after the parts */
+static void tdt4258_release(struct kref *ref);
+
+/* Drop a reference, the last one frees the device */
+static void tdt4258_put(struct tdt4258 *tdt) {
+	kref_put(&tdt->ref, tdt4258_release);
+}
+
+/* Start the sounds bound to changed buttons, defined with the DAC */
+static void dac_bindings_fire(struct tdt4258_dac *dac, uint8_t prev, uint8_t state);
+
+/* Name of a node of a device, the first device keeps the plain name */
+static void tdt4258_name(char *buff, size_t size, const char *base, int id) {
+	if (id == 0) {
+		snprintf(buff, size, "%s", base);
 	} else {
-		/* Gamepad is already in use, unlock mutex */
-		mutex_unlock(&gamepad_task_mutex);
+		snprintf(buff, size, "%s%i", base, id);
+	}
+}
 
-		printk("Failed attempt to open by PID %i, device busy\n", current->pid);
-		return -EBUSY;
+
+/* User program opens the driver */
+static int gamepad_open(struct inode *inode, struct file *filp) {
+	struct tdt4258_gamepad *pad;
+	struct gamepad_reader *reader;
+	struct tdt4258 *tdt;
+
+	/* Keep the device until the file is closed */
+	tdt = tdt4258_get(inode, gamepad_devt);
+	if (tdt == NULL) return -ENODEV;
+	pad = &tdt->gamepad;
+
+	/* Allocate per file state, starting after the events already in the ring */
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (reader == NULL) {
+		tdt4258_put(tdt);
+		return -ENOMEM;
 	}
+	mutex_init(&reader->lock);
+	reader->pad = pad;
+	gamepad_cursor_init(&pad->core, &reader->cursor);
+	filp->private_data = reader;
+
+#ifndef CONFIG_MMU
+	/* Let mmap hand out the shared page itself instead of a copy */
+	filp->f_mapping->backing_dev_info = &directly_mappable_cdev_bdi;
+#endif
+
+	/* The first process to open the driver is sent SIGUSR1 on input */
+	mutex_lock(&pad->task_mutex);
+	if (pad->task == NULL) {
+		pad->task = current;
+		reader->signalled = true;
+	}
+	mutex_unlock(&pad->task_mutex);
+
+	printk("Opened by PID %i\n", current->pid);
+	return 0;
 }
 
 /* User program closes the driver */
 static int gamepad_release(struct inode *inode, struct file *filp) {
-	/* Reset task pointer */
-	mutex_lock(&gamepad_task_mutex);
-	gamepad_task = NULL;
-	mutex_unlock(&gamepad_task_mutex);
+	struct gamepad_reader *reader = filp->private_data;
+	struct tdt4258_gamepad *pad = reader->pad;
+
+	/* Reset task pointer if this file owned it */
+	if (reader->signalled) {
+		mutex_lock(&pad->task_mutex);
+		pad->task = NULL;
+		mutex_unlock(&pad->task_mutex);
+	}
+
+	/* Stop matching gestures for this file */
+	if (reader->gestures) {
+		spin_lock_bh(&pad->gesture_lock);
+		list_del(&reader->gesture_node);
+		spin_unlock_bh(&pad->gesture_lock);
+	}
+
+	/* Stop realtime signals, the tasklet only sends them under the lock */
+	if (reader->notify) {
+		spin_lock_bh(&pad->notify_lock);
+		list_del(&reader->notify_node);
+		spin_unlock_bh(&pad->notify_lock);
+		put_pid(reader->notify_pid);
+		put_cred(reader->notify_cred);
+	}
+
+	kfree(reader);
+	tdt4258_put(container_of(pad, struct tdt4258, gamepad));
 
 	return 0;
 }
 
+/* Check if there are unread events for a reader */
+static bool gamepad_reader_pending(struct gamepad_reader *reader) {
+	return gamepad_cursor_pending(&reader->pad->core, &reader->cursor);
+}
+
+/* Check if there are unread matches for a reader with gesture patterns */
+static bool gamepad_matches_pending(struct gamepad_reader *reader) {
+	return ACCESS_ONCE(reader->matcher.head) != ACCESS_ONCE(reader->matcher.tail);
+}
+
+/* Record the delay from interrupt to user program of read events */
+static void gamepad_delivery_time(struct tdt4258_gamepad *pad, const struct gamepad_event *events,
+		unsigned int num) {
+	uint64_t now = ktime_to_ns(ktime_get());
+	unsigned int i;
+
+	spin_lock(&pad->debug_lock);
+	for (i = 0; i < num; i++) {
+		stats_hist_add(&pad->debug.delivery_ns, min_t(uint64_t, now - events[i].time, 0xffffffff));
+	}
+	spin_unlock(&pad->debug_lock);
+}
+
+/* Read matches of a file with gesture patterns */
+static ssize_t gamepad_read_matches(struct file *filp, char __user *buff, size_t count) {
+	struct gamepad_reader *reader = filp->private_data;
+	struct tdt4258_gamepad *pad = reader->pad;
+	const size_t size = sizeof(struct gamepad_match);
+	unsigned int num;
+
+	if (mutex_lock_interruptible(&reader->lock) != 0) return -ERESTARTSYS;
+
+	do {
+		/* Wait until a pattern matches, unless the file is non-blocking */
+		while (!gamepad_matches_pending(reader)) {
+			mutex_unlock(&reader->lock);
+
+			if (ACCESS_ONCE(pad->dead)) return -ENODEV;
+			if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+			if (wait_event_interruptible(pad->gesture_wq,
+					gamepad_matches_pending(reader) || ACCESS_ONCE(pad->dead)) != 0) {
+				return -ERESTARTSYS;
+			}
+
+			if (mutex_lock_interruptible(&reader->lock) != 0) return -ERESTARTSYS;
+		}
+
+		/* Take the matches that fit in buffer */
+		spin_lock_bh(&pad->gesture_lock);
+		num = gamepad_matcher_take(&reader->matcher, reader->matches,
+				min_t(size_t, count / size, GAMEPAD_MATCH_RING_SIZE));
+		spin_unlock_bh(&pad->gesture_lock);
+	} while (num == 0);
+
+	/* Copy records to user */
+	if (copy_to_user(buff, reader->matches, num * size) != 0) {
+		mutex_unlock(&reader->lock);
+		return -EFAULT;
+	}
+
+	mutex_unlock(&reader->lock);
+
+	return num * size;
+}
+
 /* User program reads from the driver */
 static ssize_t gamepad_read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
-	if (count >= 1) {
-		buff[0] = gamepad_input;
-	} else {
-		printk("Read buffer size too small for gamepad input data!\n");
+	struct gamepad_reader *reader = filp->private_data;
+	struct tdt4258_gamepad *pad = reader->pad;
+	const size_t size = sizeof(struct gamepad_event);
+	unsigned int num, first;
+	uint32_t lost;
+
+	if (ACCESS_ONCE(pad->dead)) return -ENODEV;
+
+	/* Buffers smaller than one record get the current button state */
+	if (count < size) {
+		if (count == 0) return 0;
+		if (put_user(ACCESS_ONCE(pad->core.input), buff) != 0) return -EFAULT;
+		return 1;
 	}
 
-	return 1;
+	if (ACCESS_ONCE(reader->gestures)) return gamepad_read_matches(filp, buff, count);
+
+	if (mutex_lock_interruptible(&reader->lock) != 0) return -ERESTARTSYS;
+
+	do {
+		/* Wait until there are events, unless the file is non-blocking */
+		while (!gamepad_reader_pending(reader)) {
+			mutex_unlock(&reader->lock);
+
+			if (ACCESS_ONCE(pad->dead)) return -ENODEV;
+			if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+			if (wait_event_interruptible(pad->wq,
+					gamepad_reader_pending(reader) || ACCESS_ONCE(pad->dead)) != 0) {
+				return -ERESTARTSYS;
+			}
+
+			if (mutex_lock_interruptible(&reader->lock) != 0) return -ERESTARTSYS;
+		}
+
+		/* Snapshot the whole records that are available and fit in buffer */
+		num = gamepad_cursor_snapshot(&pad->core, &reader->cursor, reader->buff,
+				count / size, &first, &lost);
+		if (lost != 0) {
+			spin_lock(&pad->debug_lock);
+			pad->debug.dropped += lost;
+			spin_unlock(&pad->debug_lock);
+		}
+	} while (num == 0);
+
+	/* Copy records to user */
+	if (copy_to_user(buff, &reader->buff[first], num * size) != 0) {
+		mutex_unlock(&reader->lock);
+		return -EFAULT;
+	}
+	reader->cursor.tail += num;
+	gamepad_delivery_time(pad, &reader->buff[first], num);
+
+	mutex_unlock(&reader->lock);
+
+	return num * size;
 }
 
 /* User program writes to the driver */
@@ -137,153 +642,1273 @@ static ssize_t gamepad_write(struct file *filp, const char __user *buff, size_t
 	return count;
 }
 
+/* User program polls the driver for events */
+static unsigned int gamepad_poll(struct file *filp, poll_table *wait) {
+	struct gamepad_reader *reader = filp->private_data;
+	struct tdt4258_gamepad *pad = reader->pad;
+
+	/* Files with gesture patterns are only woken up by matches */
+	if (ACCESS_ONCE(reader->gestures)) {
+		poll_wait(filp, &pad->gesture_wq, wait);
+		if (ACCESS_ONCE(pad->dead)) return POLLERR | POLLHUP;
+		return gamepad_matches_pending(reader) ? POLLIN | POLLRDNORM : 0;
+	}
+
+	poll_wait(filp, &pad->wq, wait);
+	if (ACCESS_ONCE(pad->dead)) return POLLERR | POLLHUP;
+
+	if (gamepad_reader_pending(reader)) {
+		return POLLIN | POLLRDNORM;
+	}
+
+	return 0;
+}
+
+/* User program maps the shared page */
+static int gamepad_mmap(struct file *filp, struct vm_area_struct *vma) {
+	struct gamepad_reader *reader = filp->private_data;
+
+	if (ACCESS_ONCE(reader->pad->dead)) return -ENODEV;
+
+	/* Only a read-only mapping of the single page is allowed */
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) return -EINVAL;
+	if (vma->vm_flags & VM_WRITE) return -EPERM;
+
+#ifdef CONFIG_MMU
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(reader->pad->page) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+#else
+	return 0; // Address was already given by gamepad_get_unmapped_area
+#endif
+}
+
+#ifndef CONFIG_MMU
+/* Without an MMU userspace uses the shared page at its kernel address */
+static unsigned long gamepad_get_unmapped_area(struct file *filp, unsigned long addr,
+		unsigned long len, unsigned long pgoff, unsigned long flags) {
+	struct gamepad_reader *reader = filp->private_data;
+
+	if (pgoff != 0 || len > PAGE_SIZE) return -EINVAL;
+
+	return (unsigned long)reader->pad->page;
+}
+#endif
+
+/* Set the gesture patterns of a file, no patterns goes back to reading events */
+static long gamepad_set_gestures(struct gamepad_reader *reader, const void __user *arg) {
+	struct tdt4258_gamepad *pad = reader->pad;
+	struct gamepad_gestures *gestures;
+	long result;
+
+	/* Copy and check patterns */
+	gestures = kmalloc(sizeof(*gestures), GFP_KERNEL);
+	if (gestures == NULL) return -ENOMEM;
+	if (copy_from_user(gestures, arg, sizeof(*gestures)) != 0) {
+		result = -EFAULT;
+		goto out;
+	}
+	result = gamepad_gestures_check(gestures);
+	if (result != 0) goto out;
+
+	/* Swap in the patterns, the tasklet only matches files on the list */
+	mutex_lock(&reader->lock);
+	spin_lock_bh(&pad->gesture_lock);
+	gamepad_matcher_set(&reader->matcher, gestures, pad->gesture_state);
+	if (gestures->count > 0 && !reader->gestures) {
+		list_add(&reader->gesture_node, &pad->gesture_readers);
+	} else if (gestures->count == 0 && reader->gestures) {
+		list_del(&reader->gesture_node);
+	}
+	reader->gestures = gestures->count > 0;
+	spin_unlock_bh(&pad->gesture_lock);
+	mutex_unlock(&reader->lock);
+
+	/* Readers blocked on this file go back and look at the new mode */
+	wake_up_interruptible(&pad->gesture_wq);
+
+out:
+	kfree(gestures);
+	return result;
+}
+
+/* Turn realtime signals to the calling process on or off for a file */
+static long gamepad_set_signal(struct gamepad_reader *reader, const void __user *arg) {
+	struct tdt4258_gamepad *pad = reader->pad;
+	const struct cred *old_cred = NULL;
+	struct pid *old_pid = NULL;
+	struct gamepad_signal sig;
+
+	if (copy_from_user(&sig, arg, sizeof(sig)) != 0) return -EFAULT;
+	if (sig.signo != 0 && (sig.signo < SIGRTMIN || sig.signo > SIGRTMAX)) return -EINVAL;
+	if (sig.interval_us > GAMEPAD_SIGNAL_INTERVAL_MAX) return -EINVAL;
+
+	/* Swap in the new target, the tasklet only signals files on the list */
+	spin_lock_bh(&pad->notify_lock);
+	if (reader->notify) {
+		old_pid = reader->notify_pid;
+		old_cred = reader->notify_cred;
+	}
+	if (sig.signo != 0) {
+		gamepad_notifier_init(&reader->notifier, (uint64_t)sig.interval_us * 1000);
+		reader->notify_signo = sig.signo;
+		reader->notify_pid = get_pid(task_tgid(current)); // The process, not the calling thread
+		reader->notify_cred = get_current_cred();
+		if (!reader->notify) list_add(&reader->notify_node, &pad->notify_readers);
+	} else if (reader->notify) {
+		list_del(&reader->notify_node);
+	}
+	reader->notify = sig.signo != 0;
+	spin_unlock_bh(&pad->notify_lock);
+
+	if (old_pid != NULL) {
+		put_pid(old_pid);
+		put_cred(old_cred);
+	}
+
+	return 0;
+}
+
+/* User program sends a control command to the driver */
+static long gamepad_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct gamepad_reader *reader = filp->private_data;
+
+	if (ACCESS_ONCE(reader->pad->dead)) return -ENODEV;
+
+	switch (cmd) {
+	case GAMEPAD_IOC_DROPPED:
+		if (ACCESS_ONCE(reader->gestures)) {
+			return put_user(ACCESS_ONCE(reader->matcher.dropped), (uint32_t __user *)arg);
+		}
+		return put_user(ACCESS_ONCE(reader->cursor.dropped), (uint32_t __user *)arg);
+	case GAMEPAD_IOC_SET_GESTURES:
+		return gamepad_set_gestures(reader, (const void __user *)arg);
+	case GAMEPAD_IOC_SET_SIGNAL:
+		return gamepad_set_signal(reader, (const void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 /* File operations struct for cdev */
 static struct file_operations gamepad_fops = {
 	.owner = THIS_MODULE,
 	.read = gamepad_read,
 	.write = gamepad_write,
+	.poll = gamepad_poll,
+	.unlocked_ioctl = gamepad_ioctl,
+	.mmap = gamepad_mmap,
+#ifndef CONFIG_MMU
+	.get_unmapped_area = gamepad_get_unmapped_area,
+#endif
 	.open = gamepad_open,
 	.release = gamepad_release
 };
 
-/* Interrupt handler */
-static irqreturn_t gamepad_irq_handler(int irq, void *dev_id) {
-	/* Read input */
-	gamepad_input = ioread32(gamepad_mem + OFF_GPIO_PC_DIN);
+/* Add the time of one handler run to the statistics */
+static void gamepad_stats_add(uint32_t *count, uint64_t *total, uint32_t *max, ktime_t start) {
+	uint32_t ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	(*count)++;
+	*total += ns;
+	if (ns > *max) *max = ns;
+}
+
+/* Report all changed buttons to the input device as one frame */
+static void gamepad_input_report(struct tdt4258_gamepad *pad, uint8_t prev, uint8_t state) {
+	uint8_t changed = prev ^ state;
+	int i;
 
-	/* Send signal to program */
-	if (gamepad_task != NULL) {
-		send_sig_info(SIGUSR1, SEND_SIG_NOINFO, gamepad_task);
+	for (i = 0; i < 8; i++) {
+		if (changed & (1 << i)) {
+			input_report_key(pad->idev, pad->keymap[i], !(state & (1 << i)));
+		}
 	}
+	input_sync(pad->idev);
+}
 
-	/* Clear interrupt */
-	iowrite32(ioread32(gamepad_mem + OFF_GPIO_IF), gamepad_mem + OFF_GPIO_IFC);
+/* Fold an input change into the pending realtime signals, called from the tasklet */
+static void gamepad_notify_event(struct tdt4258_gamepad *pad, uint8_t prev, uint8_t state) {
+	struct gamepad_reader *reader;
+
+	spin_lock(&pad->notify_lock);
+	list_for_each_entry(reader, &pad->notify_readers, notify_node) {
+		if (gamepad_notifier_event(&reader->notifier, prev, state)) pad->debug.signals_coalesced++;
+	}
+	spin_unlock(&pad->notify_lock);
+}
+
+/* Pass an input change made by the debouncer on to the shared page, input device and signals */
+static bool gamepad_publish(struct tdt4258_gamepad *pad, uint8_t prev, uint64_t time) {
+	uint8_t state = pad->core.input;
+
+	if (state == prev) return false;
+
+	/* Sound goes first, the bound sounds start on the next sample */
+	dac_bindings_fire(&container_of(pad, struct tdt4258, gamepad)->dac, prev, state);
+	gamepad_core_page_update(pad->page, prev, state, time);
+	gamepad_input_report(pad, prev, state);
+	gamepad_notify_event(pad, prev, state);
+
+	return true;
+}
+
+/* Arm the debounce timer for the earliest open window */
+static void gamepad_debounce_arm(struct tdt4258_gamepad *pad) {
+	uint64_t next;
+
+	if (gamepad_core_next_expiry(&pad->core, &next)) {
+		hrtimer_start(&pad->debounce_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+	}
+}
+
+/* Debounce timer callback, leaves the work to the tasklet */
+static enum hrtimer_restart gamepad_debounce_timer_fn(struct hrtimer *timer) {
+	struct tdt4258_gamepad *pad = container_of(timer, struct tdt4258_gamepad, debounce_timer);
+
+	tasklet_hi_schedule(&pad->tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Gesture timer callback, leaves the work to the tasklet */
+static enum hrtimer_restart gamepad_gesture_timer_fn(struct hrtimer *timer) {
+	struct tdt4258_gamepad *pad = container_of(timer, struct tdt4258_gamepad, gesture_timer);
+
+	tasklet_hi_schedule(&pad->tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Realtime signal timer callback, leaves the work to the tasklet */
+static enum hrtimer_restart gamepad_notify_timer_fn(struct hrtimer *timer) {
+	struct tdt4258_gamepad *pad = container_of(timer, struct tdt4258_gamepad, notify_timer);
+
+	tasklet_hi_schedule(&pad->tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Send the realtime signals that are due and time the earliest one still
+ * held back by its interval. Signals go to the whole thread group, so any
+ * thread that does not block them takes them. Called from the tasklet,
+ * signals are queued under the lock so a closing file cannot drop its pid
+ * in between.
+ */
+static void gamepad_notify(struct tdt4258_gamepad *pad, uint64_t now) {
+	struct gamepad_reader *reader;
+	uint64_t next, earliest = 0;
+	struct siginfo info;
+	bool timed = false;
+
+	spin_lock(&pad->notify_lock);
+	list_for_each_entry(reader, &pad->notify_readers, notify_node) {
+		if (!reader->notifier.pending) continue;
+
+		/* Keep coalescing until the interval since the last signal is over */
+		if (!gamepad_notifier_due(&reader->notifier, now, &next)) {
+			if (!timed || next < earliest) {
+				earliest = next;
+				timed = true;
+			}
+			continue;
+		}
+
+		/* Queue the signal with the state in its value */
+		memset(&info, 0, sizeof(info));
+		info.si_signo = reader->notify_signo;
+		info.si_code = SI_QUEUE;
+		info.si_int = gamepad_notifier_take(&reader->notifier, pad->core.input, now);
+		if (kill_pid_info_as_cred(reader->notify_signo, &info, reader->notify_pid,
+				reader->notify_cred, 0) == 0) {
+			pad->debug.signals++;
+		} else {
+			pad->debug.signals_lost++;
+		}
+	}
+	spin_unlock(&pad->notify_lock);
+
+	if (timed) hrtimer_start(&pad->notify_timer, ns_to_ktime(earliest), HRTIMER_MODE_ABS);
+}
+
+/*
+ * Run new events and completed long presses through the gesture matchers,
+ * returns true if any pattern matched. Called from the tasklet, which is the
+ * only writer of the event ring.
+ */
+static bool gamepad_gesture_match(struct tdt4258_gamepad *pad, uint64_t now) {
+	unsigned int head = pad->core.head;
+	struct gamepad_reader *reader;
+	unsigned int matches = 0;
+	uint64_t next, earliest = 0;
+	bool timed = false;
+	unsigned int tail;
+
+	/* Events older than one ring were overwritten before they could be matched */
+	if (head - pad->gesture_tail > GAMEPAD_RING_SIZE) pad->gesture_tail = head - GAMEPAD_RING_SIZE;
+
+	spin_lock(&pad->gesture_lock);
+	list_for_each_entry(reader, &pad->gesture_readers, gesture_node) {
+		for (tail = pad->gesture_tail; tail != head; tail++) {
+			matches += gamepad_matcher_event(&reader->matcher,
+					&pad->core.events[tail & (GAMEPAD_RING_SIZE - 1)]);
+		}
+		matches += gamepad_matcher_expire(&reader->matcher, now);
+
+		/* Find the earliest long press to time */
+		if (gamepad_matcher_next_deadline(&reader->matcher, &next) && (!timed || next < earliest)) {
+			earliest = next;
+			timed = true;
+		}
+	}
+	if (head != pad->gesture_tail) {
+		pad->gesture_state = pad->core.events[(head - 1) & (GAMEPAD_RING_SIZE - 1)].state;
+		pad->gesture_tail = head;
+	}
+	spin_unlock(&pad->gesture_lock);
+
+	if (timed) hrtimer_start(&pad->gesture_timer, ns_to_ktime(earliest), HRTIMER_MODE_ABS);
+
+	return matches > 0;
+}
+
+/* Tasklet processing latched input, runs after the interrupt handler */
+static void gamepad_tasklet_fn(unsigned long data) {
+	struct tdt4258_gamepad *pad = (struct tdt4258_gamepad *)data;
+	ktime_t start = ktime_get();
+	bool changed = false;
+	unsigned int tail, index;
+	uint32_t latency;
+	uint64_t now;
+	uint8_t prev;
+
+	/* The device is going away, leave the timers stopped */
+	if (ACCESS_ONCE(pad->stopping)) return;
+
+	/* Turn latched samples into events */
+	for (tail = pad->latch.tail; tail != ACCESS_ONCE(pad->latch.head); tail++) {
+		smp_rmb(); // Read head before the sample it covers
+		index = tail & (GAMEPAD_LATCH_SIZE - 1);
+		prev = pad->core.input;
+		gamepad_core_sample(&pad->core, pad->latch.samples[index].din,
+				pad->latch.samples[index].flags, ktime_to_ns(pad->latch.samples[index].time));
+		changed |= gamepad_publish(pad, prev, ktime_to_ns(pad->latch.samples[index].time));
+
+		/* Track the worst delay between the interrupt and delivery */
+		latency = ktime_to_ns(ktime_sub(ktime_get(), pad->latch.samples[index].time));
+		if (latency > pad->stats.latency_max_ns) pad->stats.latency_max_ns = latency;
+
+		smp_mb(); // Finish reading sample before handing it back
+		pad->latch.tail = tail + 1;
+	}
+
+	/* Handle debounce windows that ran out */
+	now = ktime_to_ns(ktime_get());
+	prev = pad->core.input;
+	gamepad_core_expire(&pad->core, now);
+	changed |= gamepad_publish(pad, prev, now);
+	gamepad_debounce_arm(pad);
+
+	/* Readers with gesture patterns are only woken up by a match */
+	if (gamepad_gesture_match(pad, now)) wake_up_interruptible(&pad->gesture_wq);
+
+	/* Wake up readers and send signal to program */
+	if (changed) {
+		wake_up_interruptible(&pad->wq);
+		if (pad->task != NULL) {
+			send_sig_info(SIGUSR1, SEND_SIG_NOINFO, pad->task);
+		}
+	}
+	gamepad_notify(pad, now);
+
+	gamepad_stats_add(&pad->stats.bottom_count, &pad->stats.bottom_ns,
+			&pad->stats.bottom_max_ns, start);
+}
+
+/*
+ * Latch a sample for the tasklet. Called from the interrupt handler and the
+ * sampling timer, which never run at the same time: both are hard interrupt
+ * context on a single CPU, and the pin interrupts are masked while polling.
+ */
+static void gamepad_latch_push(struct tdt4258_gamepad *pad, ktime_t time, uint8_t din, uint8_t flags) {
+	unsigned int head = pad->latch.head;
+
+	if (head - ACCESS_ONCE(pad->latch.tail) < GAMEPAD_LATCH_SIZE) {
+		pad->latch.samples[head & (GAMEPAD_LATCH_SIZE - 1)].time = time;
+		pad->latch.samples[head & (GAMEPAD_LATCH_SIZE - 1)].din = din;
+		pad->latch.samples[head & (GAMEPAD_LATCH_SIZE - 1)].flags = flags;
+		smp_wmb(); // Write sample before moving head past it
+		pad->latch.head = head + 1;
+	} else {
+		pad->stats.latch_overruns++;
+	}
+
+	/* Input goes before other deferred work, audio is fed from hard interrupts */
+	tasklet_hi_schedule(&pad->tasklet);
+}
+
+/* Sampling timer callback, hands interrupts back once the pins are quiet */
+static enum hrtimer_restart gamepad_poll_timer_fn(struct hrtimer *timer) {
+	struct tdt4258_gamepad *pad = container_of(timer, struct tdt4258_gamepad, poll_timer);
+	ktime_t now = ktime_get();
+	uint8_t din = hal_read(pad->mem, OFF_GPIO_PC_DIN);
+
+	if (gamepad_core_poll(&pad->core, din, ktime_to_ns(now))) {
+		/* Unmask, then sample again so an edge just before is not lost */
+		hal_write(pad->mem, OFF_GPIO_IFC, 0xff);
+		hal_write(pad->mem, OFF_GPIO_IEN, 0xff);
+		din = hal_read(pad->mem, OFF_GPIO_PC_DIN);
+	}
+	gamepad_latch_push(pad, now, din, 0);
+
+	if (!pad->core.polling) return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(GAMEPAD_POLL_US * 1000));
+	return HRTIMER_RESTART;
+}
+
+/* Interrupt handler, only latches input and leaves the rest to the tasklet */
+static irqreturn_t gamepad_irq_handler(int irq, void *dev_id) {
+	struct tdt4258_gamepad *pad = dev_id;
+	uint32_t cycles = cycles_now();
+	ktime_t start = ktime_get();
+	uint8_t din, flags;
+
+	/* Read input and clear interrupt */
+	gamepad_core_latch(pad->mem, &din, &flags);
+	gamepad_latch_push(pad, start, din, flags);
+
+	/* Switch to polling when edges come in too fast, like a bouncing or noisy pin */
+	if (gamepad_core_rate(&pad->core, din, flags, ktime_to_ns(start))) {
+		hal_write(pad->mem, OFF_GPIO_IEN, 0x0);
+		hrtimer_start(&pad->poll_timer, ns_to_ktime(GAMEPAD_POLL_US * 1000), HRTIMER_MODE_REL);
+	}
+
+	gamepad_stats_add(&pad->stats.top_count, &pad->stats.top_ns,
+			&pad->stats.top_max_ns, start);
+	stats_hist_add(&pad->debug.irq_cycles, cycles_now() - cycles);
 
 	return IRQ_HANDLED;
 }
 
-/* Configure and enable gamepad hardware */
-static int gamepad_probe(struct platform_device *p_dev) {
-	int result;
+/* Statistics attributes of the gamepad device */
+#define GAMEPAD_STAT_ATTR(name, format) \
+	static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) { \
+		struct tdt4258 *tdt = dev_get_drvdata(dev); \
+		return sprintf(buf, format "\n", tdt->gamepad.stats.name); \
+	} \
+	static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL)
+
+GAMEPAD_STAT_ATTR(top_count, "%u");
+GAMEPAD_STAT_ATTR(top_ns, "%llu");
+GAMEPAD_STAT_ATTR(top_max_ns, "%u");
+GAMEPAD_STAT_ATTR(bottom_count, "%u");
+GAMEPAD_STAT_ATTR(bottom_ns, "%llu");
+GAMEPAD_STAT_ATTR(bottom_max_ns, "%u");
+GAMEPAD_STAT_ATTR(latch_overruns, "%u");
+GAMEPAD_STAT_ATTR(latency_max_ns, "%u");
+
+/* Debouncer counters */
+#define GAMEPAD_CORE_ATTR(name, format) \
+	static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) { \
+		struct tdt4258 *tdt = dev_get_drvdata(dev); \
+		return sprintf(buf, format "\n", tdt->gamepad.core.name); \
+	} \
+	static DEVICE_ATTR(name, S_IRUGO, name##_show, NULL)
+
+GAMEPAD_CORE_ATTR(raw_edges, "%u");
+GAMEPAD_CORE_ATTR(suppressed_edges, "%u");
+GAMEPAD_CORE_ATTR(polling, "%u");
+GAMEPAD_CORE_ATTR(poll_entries, "%u");
+GAMEPAD_CORE_ATTR(poll_exits, "%u");
+GAMEPAD_CORE_ATTR(poll_samples, "%u");
+
+/* Debounce window attribute, in microseconds */
+static ssize_t debounce_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ACCESS_ONCE(tdt->gamepad.core.window_ns) / 1000);
+}
+
+static ssize_t debounce_us_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+	unsigned int us;
+
+	if (kstrtouint(buf, 0, &us) != 0 || us > 1000000) return -EINVAL;
+	ACCESS_ONCE(tdt->gamepad.core.window_ns) = us * 1000;
+
+	return count;
+}
+static DEVICE_ATTR(debounce_us, S_IRUGO | S_IWUSR, debounce_us_show, debounce_us_store);
+
+/* Leading-edge debouncing, 0 delivers settled levels only */
+static ssize_t debounce_leading_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ACCESS_ONCE(tdt->gamepad.core.leading));
+}
+
+static ssize_t debounce_leading_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+	bool leading;
+
+	if (strtobool(buf, &leading) != 0) return -EINVAL;
+	ACCESS_ONCE(tdt->gamepad.core.leading) = leading;
+
+	return count;
+}
+static DEVICE_ATTR(debounce_leading, S_IRUGO | S_IWUSR, debounce_leading_show, debounce_leading_store);
+
+/* Edge rate that starts polling, in edges per second */
+static ssize_t poll_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ACCESS_ONCE(tdt->gamepad.core.poll_rate));
+}
+
+static ssize_t poll_rate_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+	unsigned int rate;
+
+	if (kstrtouint(buf, 0, &rate) != 0 || rate > 1000000) return -EINVAL;
+	ACCESS_ONCE(tdt->gamepad.core.poll_rate) = rate;
+
+	return count;
+}
+static DEVICE_ATTR(poll_rate, S_IRUGO | S_IWUSR, poll_rate_show, poll_rate_store);
+
+static struct attribute *gamepad_attrs[] = {
+	&dev_attr_top_count.attr,
+	&dev_attr_top_ns.attr,
+	&dev_attr_top_max_ns.attr,
+	&dev_attr_bottom_count.attr,
+	&dev_attr_bottom_ns.attr,
+	&dev_attr_bottom_max_ns.attr,
+	&dev_attr_latch_overruns.attr,
+	&dev_attr_latency_max_ns.attr,
+	&dev_attr_raw_edges.attr,
+	&dev_attr_suppressed_edges.attr,
+	&dev_attr_debounce_us.attr,
+	&dev_attr_debounce_leading.attr,
+	&dev_attr_polling.attr,
+	&dev_attr_poll_entries.attr,
+	&dev_attr_poll_exits.attr,
+	&dev_attr_poll_samples.attr,
+	&dev_attr_poll_rate.attr,
+	NULL
+};
+
+static const struct attribute_group gamepad_attr_group = {
+	.attrs = gamepad_attrs
+};
+
+/* Register input device for the buttons */
+static int gamepad_input_probe(struct tdt4258_gamepad *pad, struct platform_device *p_dev) {
+	int result;
+	int i;
+
+	pad->idev = input_allocate_device();
+	if (pad->idev == NULL) return -ENOMEM;
+
+	snprintf(pad->phys, sizeof(pad->phys), "%s/input0", pad->name);
+	pad->idev->name = "TDT4258 gamepad";
+	pad->idev->phys = pad->phys;
+	pad->idev->id.bustype = BUS_HOST;
+	pad->idev->dev.parent = &p_dev->dev;
+
+	/* Keys, remappable through EVIOCSKEYCODE */
+	memcpy(pad->keymap, gamepad_keymap, sizeof(pad->keymap));
+	pad->idev->keycode = pad->keymap;
+	pad->idev->keycodesize = sizeof(pad->keymap[0]);
+	pad->idev->keycodemax = ARRAY_SIZE(pad->keymap);
+	for (i = 0; i < 8; i++) {
+		input_set_capability(pad->idev, EV_KEY, pad->keymap[i]);
+	}
+
+	result = input_register_device(pad->idev);
+	if (result != 0) {
+		input_free_device(pad->idev);
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the tasklet and the timers once the pin interrupts are freed. The
+ * timers schedule the tasklet and the tasklet starts them again, so the
+ * tasklet is made to do nothing first, then the timers are cancelled and
+ * the runs they scheduled are waited for.
+ */
+static void gamepad_stop(struct tdt4258_gamepad *pad) {
+	/* Polling may have unmasked the pins again */
+	hrtimer_cancel(&pad->poll_timer);
+	hal_write(pad->mem, OFF_GPIO_IEN, 0x0);
+
+	ACCESS_ONCE(pad->stopping) = true;
+	tasklet_kill(&pad->tasklet); // Later runs see stopping
+	hrtimer_cancel(&pad->debounce_timer);
+	hrtimer_cancel(&pad->gesture_timer);
+	hrtimer_cancel(&pad->notify_timer);
+	tasklet_kill(&pad->tasklet); // Runs scheduled by the timers
+}
+
+/* Configure and enable gamepad hardware */
+static int gamepad_probe(struct tdt4258 *tdt, struct platform_device *p_dev) {
+	struct tdt4258_gamepad *pad = &tdt->gamepad;
+	int result;
+
+	/* Init locks and wait queues before anything can use them */
+	mutex_init(&pad->task_mutex);
+	init_waitqueue_head(&pad->wq);
+	INIT_LIST_HEAD(&pad->gesture_readers);
+	spin_lock_init(&pad->gesture_lock);
+	init_waitqueue_head(&pad->gesture_wq);
+	INIT_LIST_HEAD(&pad->notify_readers);
+	spin_lock_init(&pad->notify_lock);
+	spin_lock_init(&pad->debug_lock);
+	tdt4258_name(pad->name, sizeof(pad->name), CDEV_GAMEPAD, tdt->id);
+
+	/* Get platform info */
+	pad->res = platform_get_resource(p_dev, IORESOURCE_MEM, GAMEPAD_RESOURCE_NUM);
+	printk("Gamepad base addr: %x\n", pad->res->start);
+	pad->irq_even = platform_get_irq(p_dev, 0);
+	pad->irq_odd = platform_get_irq(p_dev, 1);
+	printk("Interrupt even: %i, odd: %i\n", pad->irq_even, pad->irq_odd);
+
+	/* Map memory region */
+	pad->mem = hal_map(pad->res->start, pad->res->end - pad->res->start);
+	if (pad->mem == NULL) return -ENOMEM; // Failed to map registers
+
+	/* Configure GPIO buttons */
+	hal_write(pad->mem, OFF_GPIO_PC_MODEL, 0x33333333);
+	hal_write(pad->mem, OFF_GPIO_PC_DOUT, 0xFF);
+	gamepad_core_init(&pad->core, hal_read(pad->mem, OFF_GPIO_PC_DIN));
+
+	/* Allocate page shared with userspace */
+	pad->page = (struct gamepad_shared *)get_zeroed_page(GFP_KERNEL);
+	if (pad->page == NULL) {
+		result = -ENOMEM;
+		goto out_unmap; // Failed to allocate shared page
+	}
+	pad->page->state = pad->core.input;
+
+	/* Register input device */
+	result = gamepad_input_probe(pad, p_dev);
+	if (result != 0) goto out_page; // Failed to register input device
+
+	/* Set up debounce timer */
+	hrtimer_init(&pad->debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pad->debounce_timer.function = gamepad_debounce_timer_fn;
+	hrtimer_init(&pad->gesture_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pad->gesture_timer.function = gamepad_gesture_timer_fn;
+	pad->gesture_state = pad->core.input;
+	hrtimer_init(&pad->notify_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pad->notify_timer.function = gamepad_notify_timer_fn;
+	hrtimer_init(&pad->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pad->poll_timer.function = gamepad_poll_timer_fn;
+
+	/* Register interrupt handler */
+	tasklet_init(&pad->tasklet, gamepad_tasklet_fn, (unsigned long)pad);
+	result = request_irq(pad->irq_even, (irq_handler_t)gamepad_irq_handler,
+			0, pad->name, pad);
+	if (result != 0) goto out_input; // Failed to set up interrupts
+	result = request_irq(pad->irq_odd, (irq_handler_t)gamepad_irq_handler,
+			0, pad->name, pad);
+	if (result != 0) goto out_irq_even; // Failed to set up interrupts
+
+	/* Configure GPIO interrupt generation */
+	hal_write(pad->mem, OFF_GPIO_EXTIPSELL, 0x22222222);
+	hal_write(pad->mem, OFF_GPIO_EXTIFALL, 0xff);
+	hal_write(pad->mem, OFF_GPIO_EXTIRISE, 0xff);
+	hal_write(pad->mem, OFF_GPIO_IEN, 0xff);
+
+	/* Take the device number of this instance from the reserved range */
+	pad->dev = MKDEV(MAJOR(gamepad_devt), MINOR(gamepad_devt) + tdt->id);
+	printk("Device number allocated: major %i, minor %i\n", MAJOR(pad->dev), MINOR(pad->dev));
+
+	/* Initialize cdev */
+	cdev_init(&pad->cdev, &gamepad_fops);
+	result = cdev_add(&pad->cdev, pad->dev, 1);
+	if (result < 0) goto out_irqs; // Failed to add cdev
+
+	/* Make visible in userspace */
+	pad->device = device_create(gamepad_cl, &p_dev->dev, pad->dev, tdt, "%s", pad->name);
+	if (IS_ERR(pad->device)) {
+		result = PTR_ERR(pad->device);
+		goto out_cdev; // Failed to create device node
+	}
+
+	/* Export statistics */
+	result = sysfs_create_group(&pad->device->kobj, &gamepad_attr_group);
+	if (result < 0) goto out_device; // Failed to create attributes
+	
+	return 0;
+
+	/* Undo in reverse order */
+out_device:
+	device_destroy(gamepad_cl, pad->dev);
+out_cdev:
+	cdev_del(&pad->cdev);
+out_irqs:
+	hal_write(pad->mem, OFF_GPIO_IEN, 0x0);
+	free_irq(pad->irq_odd, pad);
+out_irq_even:
+	free_irq(pad->irq_even, pad);
+	gamepad_stop(pad);
+out_input:
+	input_unregister_device(pad->idev);
+out_page:
+	free_page((unsigned long)pad->page);
+	pad->page = NULL;
+out_unmap:
+	hal_write(pad->mem, OFF_GPIO_PC_MODEL, 0x0);
+	hal_unmap(pad->mem);
+	return result;
+}
+
+/* Disable gamepad hardware */
+static void gamepad_remove(struct tdt4258_gamepad *pad) {
+	/* Disable GPIO interrupt generation */
+	hal_write(pad->mem, OFF_GPIO_IEN, 0x0);
+
+	/* Unregister interrupt handler, then stop the deferred work */
+	free_irq(pad->irq_even, pad);
+	free_irq(pad->irq_odd, pad);
+	gamepad_stop(pad);
+
+	/* Unregister input device */
+	input_unregister_device(pad->idev);
+
+	/* Disable GPIO buttons */
+	hal_write(pad->mem, OFF_GPIO_PC_MODEL, 0x0);
+
+	/* Unmap memory region, the shared page stays until the last file is closed */
+	hal_unmap(pad->mem);
+
+	/* Delete class */
+	sysfs_remove_group(&pad->device->kobj, &gamepad_attr_group);
+	device_destroy(gamepad_cl, pad->dev);
+
+	/* Delete cdev */
+	cdev_del(&pad->cdev);
+}
+
+
+/* Fill one half of the DMA buffer from the PCM ring and rearm it, returns frames taken */
+static unsigned int dac_dma_refill(struct tdt4258_dac *dac, int half) {
+	uint32_t *buff = dac->dma.buff + half * DAC_DMA_FRAMES;
+	unsigned int tail = dac->pcm.tail;
+	unsigned int num, i;
+
+	/* Copy queued frames */
+	num = min_t(unsigned int, ACCESS_ONCE(dac->pcm.head) - tail, DAC_DMA_FRAMES);
+	smp_rmb(); // Read head before the frames it covers
+	for (i = 0; i < num; i++) {
+		buff[i] = dac->pcm.frames[(tail + i) & (DAC_PCM_RING_SIZE - 1)];
+	}
+	smp_mb(); // Finish reading frames before handing them back
+	dac->pcm.tail = tail + num;
+
+	/* Hold the last level for the rest of the half */
+	if (num > 0) dac->dma.last = buff[num - 1];
+	for (i = num; i < DAC_DMA_FRAMES; i++) {
+		buff[i] = dac->dma.last;
+	}
+
+	dac->dma.desc[half * DAC_DMA_ALT].ctrl = DAC_DMA_CTRL;
+
+	return num;
+}
+
+/* Start feeding the DAC with DMA, called with dac->lock held */
+static void dac_dma_start(struct tdt4258_dac *dac) {
+	dac->dma.starved = false;
+	dac_dma_refill(dac, 0);
+	dac_dma_refill(dac, 1);
+
+	hal_write(dac->dma.mem, OFF_DMA_CHALTC, 1); // Start with primary descriptor
+	hal_write(dac->dma.mem, OFF_DMA_CHENS, 1); // Enable channel 0
+
+	dac->dma.active = true;
+}
+
+/* Stop feeding the DAC with DMA, called with dac->lock held */
+static void dac_dma_stop(struct tdt4258_dac *dac) {
+	hal_write(dac->dma.mem, OFF_DMA_CHENC, 1); // Disable channel 0
+
+	dac->dma.active = false;
+}
+
+/* Start DAC playback, called with dac->lock held */
+static void dac_start_playback(struct tdt4258_dac *dac) {
+	if (dac->dead) return; // The registers are unmapped
+
+	if (dac->state.mode == DAC_MODE_PCM && dac->dma.enabled) {
+		/* Let DMA write a sample each time the timer triggers a conversion */
+		dac_dma_start(dac);
+		hal_write(dac->mem, OFF_DAC0_CH0CTRL, 1 | (1 << 2)); // Enable channel 0, convert on PRS channel 0
+		hal_write(dac->mem, OFF_DAC0_CH1CTRL, 1 | (1 << 2)); // Enable channel 1, convert on PRS channel 0
+		hal_write(dac->timer_mem, OFF_TIMER_IEN, 0); // Disable interrupt generation
+	} else {
+		/* Enable DAC */
+		hal_write(dac->mem, OFF_DAC0_CH0CTRL, 1); // Disable channel 0
+		hal_write(dac->mem, OFF_DAC0_CH1CTRL, 1); // Disable channel 1
+		hal_write(dac->timer_mem, OFF_TIMER_IEN, 1); // Enable interrupt generation
+	}
+
+	/* Enable timer */
+	hal_write(dac->timer_mem, OFF_TIMER_CMD, 0b1); // Send start command
+
+	dac->state.running = true;
+}
+
+/* Disable DAC playback, called with dac->lock held */
+static void dac_stop_playback(struct tdt4258_dac *dac) {
+	/* Disable DAC */
+	hal_write(dac->mem, OFF_DAC0_CH0CTRL, 0); // Disable channel 0
+	hal_write(dac->mem, OFF_DAC0_CH1CTRL, 0); // Disable channel 1
+
+	/* Disable timer */
+	hal_write(dac->timer_mem, OFF_TIMER_IEN, 0); // Disable interrupt generation
+	hal_write(dac->timer_mem, OFF_TIMER_CMD, 0b10); // Send stop command
+
+	/* Stop DMA */
+	if (dac->dma.active) dac_dma_stop(dac);
+
+	dac->state.running = false;
+}
+
+/*
+ * Wake the renderer once voices start playing, called with dac->synth_lock
+ * held. The renderer starts playback when it has queued samples and stops
+ * rendering when nothing is left, after which the interrupt stops playback.
+ */
+static void dac_synth_update_playback(struct tdt4258_dac *dac) {
+	unsigned long flags;
+
+	if (dac->state.mode == DAC_MODE_PCM || !dac->render.idle) return;
+	if (!dac_core_playing(&dac->seq, &dac->synth)) return;
+
+	spin_lock_irqsave(&dac->lock, flags);
+	dac->render.idle = false;
+	spin_unlock_irqrestore(&dac->lock, flags);
+
+	wake_up(&dac->render.wq);
+}
+
+/* Render one block into the PCM ring, returns false if there was no room or nothing to play */
+static bool dac_render_block(struct tdt4258_dac *dac) {
+	unsigned int block = ACCESS_ONCE(dac->render.block);
+	unsigned int head, num, done;
+	uint32_t start, cycles = 0;
+	unsigned long flags;
+
+	for (done = 0; done < block; done += num) {
+		spin_lock_bh(&dac->synth_lock);
+		head = dac->pcm.head;
+
+		/* Give up if playback was reset or switched to PCM since the last chunk */
+		if (dac->state.mode == DAC_MODE_PCM || dac->render.idle) {
+			spin_unlock_bh(&dac->synth_lock);
+			return false;
+		}
+
+		if (done == 0) {
+			/* Keep at most two blocks queued */
+			if (head - ACCESS_ONCE(dac->pcm.tail) > block) {
+				spin_unlock_bh(&dac->synth_lock);
+				return false;
+			}
+
+			/* Go idle once everything has fallen silent, the interrupt plays out the ring */
+			if (!dac_core_playing(&dac->seq, &dac->synth)) {
+				spin_lock_irqsave(&dac->lock, flags);
+				dac->render.idle = true;
+				spin_unlock_irqrestore(&dac->lock, flags);
+				spin_unlock_bh(&dac->synth_lock);
+				return false;
+			}
+
+			stats_hist_add(&dac->debug.render_fill, head - ACCESS_ONCE(dac->pcm.tail));
+		}
+
+		/* Render a chunk, holding the lock briefly so bound sounds are not held up */
+		start = cycles_now();
+		num = min_t(unsigned int, block - done, DAC_RENDER_CHUNK);
+		dac_core_render_block(&dac->seq, &dac->synth, dac->pcm.frames,
+				DAC_PCM_RING_SIZE - 1, head, num);
+		smp_wmb(); // Write frames before moving head past them
+		dac->pcm.head = head + num;
+		cycles += cycles_now() - start;
+
+		/* Start the sample timer once there is something to play */
+		spin_lock_irqsave(&dac->lock, flags);
+		if (!dac->state.running) dac_start_playback(dac);
+		spin_unlock_irqrestore(&dac->lock, flags);
+
+		spin_unlock_bh(&dac->synth_lock);
+	}
+
+	stats_hist_add(&dac->debug.render_cycles, cycles);
+
+	return true;
+}
+
+/* Check if the renderer has room for a block, or should exit */
+static bool dac_render_due(struct tdt4258_dac *dac) {
+	return kthread_should_stop() || (!ACCESS_ONCE(dac->render.idle) &&
+			ACCESS_ONCE(dac->pcm.head) - ACCESS_ONCE(dac->pcm.tail) <= ACCESS_ONCE(dac->render.block));
+}
+
+/* Renderer thread, synthesizes tones outside the sample interrupt */
+static int dac_render_thread(void *data) {
+	struct tdt4258_dac *dac = data;
+
+	while (!kthread_should_stop()) {
+		if (wait_event_interruptible(dac->render.wq, dac_render_due(dac)) != 0) continue;
+
+		while (dac_render_block(dac));
+	}
+
+	return 0;
+}
+
+/* Set voice frequency in millihertz, 0 stops it, called with dac->synth_lock held */
+static void dac_synth_set_freq(struct tdt4258_dac *dac, int voice, uint32_t millihertz) {
+	dac_voice_set_freq(&dac->synth, voice, millihertz);
+	dac_synth_update_playback(dac);
+}
+
+/* Change a voice */
+static int dac_synth_set_voice(struct tdt4258_dac *dac, const struct dac_voice_ctl *ctl) {
+
+	if (ctl->voice >= DAC_VOICES || ctl->waveform >= DAC_WAVE_COUNT) return -EINVAL;
+	if (ctl->volume > 0xfff || ctl->freq > DAC_SYNTH_RATE * 1000 / 2) return -EINVAL;
+
+	/* Update voice between two samples */
+	spin_lock_bh(&dac->synth_lock);
+	dac->synth.voices[ctl->voice].wavetable = dac_wavetables[ctl->waveform];
+	dac->synth.voices[ctl->voice].volume = ctl->volume;
+	dac_synth_set_freq(dac, ctl->voice, ctl->freq);
+	spin_unlock_bh(&dac->synth_lock);
+
+	return 0;
+}
+
+/* Set voice 0 note frequency in millihertz, 0 stops it */
+static int dac_set_freq(struct tdt4258_dac *dac, uint32_t millihertz) {
+
+	if (millihertz > DAC_SYNTH_RATE * 1000 / 2) return -EINVAL;
+
+	spin_lock_bh(&dac->synth_lock);
+	dac_synth_set_freq(dac, 0, millihertz);
+	spin_unlock_bh(&dac->synth_lock);
+
+	return 0;
+}
+
+/* Stop playback and drop queued PCM frames and the score, called with dac->mutex held */
+static void dac_reset(struct tdt4258_dac *dac) {
+	struct dac_seq_event *old;
+	unsigned long flags;
+
+	/* The renderer drops a block in progress once it sees idle */
+	spin_lock_bh(&dac->synth_lock);
+	spin_lock_irqsave(&dac->lock, flags);
+	dac_stop_playback(dac);
+	dac->pcm.tail = dac->pcm.head;
+	dac->render.idle = true;
+	dac->bound.active = 0;
+	dac->bound.timed = 0;
+	dac->bound.clips_active = 0;
+	spin_unlock_irqrestore(&dac->lock, flags);
+	dac_resample_init(&dac->pcm.resampler, dac->pcm.format.rate);
+	dac->synth.active = 0;
+	dac->synth.timed = 0;
+	dac->synth.clips_active = 0;
+	old = dac_seq_swap(&dac->seq, NULL, 0, 0);
+	spin_unlock_bh(&dac->synth_lock);
+
+	kfree(old);
+
+	wake_up_interruptible(&dac->wq);
+}
+
+/*
+ * Start the sounds bound to changed buttons, called from the gamepad tasklet.
+ * They play on the bound synthesizer, which the timer interrupt mixes onto
+ * the rendered frames, so they begin with the next sample instead of behind
+ * the blocks already queued. Stop bindings also silence the voice on the
+ * rendered synthesizer.
+ */
+static void dac_bindings_fire(struct tdt4258_dac *dac, uint8_t prev, uint8_t state) {
+	uint8_t changed = prev ^ state;
+	const struct dac_binding *bind;
+	unsigned long flags;
+	int i;
+
+	/* Softirq context, the other users of synth_lock disable bottom halves */
+	spin_lock(&dac->synth_lock);
+	if (dac->state.mode != DAC_MODE_PCM) {
+		spin_lock_irqsave(&dac->lock, flags);
+		for (i = 0; i < 8; i++) {
+			if (!(changed & (1 << i))) continue;
+
+			/* A cleared bit means the button is down */
+			bind = state & (1 << i) ? &dac->bindings.release[i] : &dac->bindings.press[i];
+			dac_binding_apply(&dac->bound, &dac->bank, bind);
+			if (bind->type == DAC_BIND_STOP) dac_binding_apply(&dac->synth, &dac->bank, bind);
+		}
+		if ((dac->bound.active | dac->bound.clips_active) != 0 && !dac->state.running) {
+			dac_start_playback(dac);
+		}
+		spin_unlock_irqrestore(&dac->lock, flags);
+	}
+	spin_unlock(&dac->synth_lock);
+}
+
+/* Replace the button bindings, called with dac->mutex held */
+static long dac_set_bindings(struct tdt4258_dac *dac, const void __user *arg) {
+	struct dac_bindings *bindings;
+	long result = 0;
+	int i;
+
+	/* Copy and check all bindings before using any of them */
+	bindings = kmalloc(sizeof(*bindings), GFP_KERNEL);
+	if (bindings == NULL) return -ENOMEM;
+	if (copy_from_user(bindings, arg, sizeof(*bindings)) != 0) {
+		result = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < 8 && result == 0; i++) {
+		result = dac_binding_check(&bindings->press[i]);
+		if (result == 0) result = dac_binding_check(&bindings->release[i]);
+	}
+	if (result != 0) goto out;
+
+	spin_lock_bh(&dac->synth_lock);
+	dac->bindings = *bindings;
+	spin_unlock_bh(&dac->synth_lock);
 
-	/* Get platform info */
-	gamepad_res = platform_get_resource(p_dev, IORESOURCE_MEM, GAMEPAD_RESOURCE_NUM);
-	printk("Gamepad base addr: %x\n", gamepad_res->start);
-	gamepad_irq_even = platform_get_irq(p_dev, 0);
-	gamepad_irq_odd = platform_get_irq(p_dev, 1);
-	printk("Interrupt even: %i, odd: %i\n", gamepad_irq_even, gamepad_irq_odd);
+out:
+	kfree(bindings);
+	return result;
+}
 
-	/* Map memory region */
-	gamepad_mem = ioremap_nocache(gamepad_res->start, gamepad_res->end - gamepad_res->start);
+/* Take a clip out of the bank and free it, called with dac->mutex held */
+static void dac_clip_unload_slot(struct tdt4258_dac *dac, int slot) {
+	unsigned long flags;
+	int16_t *samples;
+
+	/* Voices still playing it are stopped between two samples */
+	spin_lock_bh(&dac->synth_lock);
+	samples = dac_clip_remove(&dac->bank, &dac->synth, slot);
+	spin_lock_irqsave(&dac->lock, flags);
+	dac_clip_stop(&dac->bound, samples);
+	spin_unlock_irqrestore(&dac->lock, flags);
+	dac_synth_update_playback(dac);
+	spin_unlock_bh(&dac->synth_lock);
+
+	kfree(samples);
+}
 
-	/* Configure GPIO buttons */
-	iowrite32(0x33333333, gamepad_mem + OFF_GPIO_PC_MODEL);
-	iowrite32(0xFF, gamepad_mem + OFF_GPIO_PC_DOUT);
+/* Upload a clip, evicting the least recently played ones if it does not fit, called with dac->mutex held */
+static long dac_clip_load(struct tdt4258_dac *dac, struct dac_clip_load __user *arg) {
+	struct dac_clip_load load;
+	int16_t *samples;
+	size_t size;
+	int slot;
+
+	/* Copy and check request */
+	if (copy_from_user(&load, arg, sizeof(load)) != 0) return -EFAULT;
+	if (load.reserved != 0 || load.count == 0) return -EINVAL;
+	if (load.count > dac->bank.bytes_max / sizeof(int16_t)) return -ENOSPC;
+	load.name[DAC_CLIP_NAME_LEN - 1] = '\0';
+	size = load.count * sizeof(int16_t);
+
+	/* Copy samples before touching the bank, so a bad upload leaves it as it was */
+	samples = kmalloc(size, GFP_KERNEL);
+	if (samples == NULL) return -ENOMEM;
+	if (copy_from_user(samples, (const void __user *)(uintptr_t)load.samples, size) != 0) {
+		kfree(samples);
+		return -EFAULT;
+	}
 
-	/* Register interrupt handler */
-	result = request_irq(gamepad_irq_even, (irq_handler_t)gamepad_irq_handler,
-			0, CDEV_GAMEPAD, 0);
-	if (result != 0) return -1; // Failed to set up interrupts
-	result = request_irq(gamepad_irq_odd, (irq_handler_t)gamepad_irq_handler,
-			0, CDEV_GAMEPAD, 0);
-	if (result != 0) return -1; // Failed to set up interrupts
+	/* Replace a clip with the same name */
+	slot = dac_clip_find(&dac->bank, load.name);
+	if (slot >= 0) dac_clip_unload_slot(dac, slot);
 
-	/* Configure GPIO interrupt generation */
-	iowrite32(0x22222222, gamepad_mem + OFF_GPIO_EXTIPSELL);
-	iowrite32(0xff, gamepad_mem + OFF_GPIO_EXTIFALL);
-	iowrite32(0xff, gamepad_mem + OFF_GPIO_EXTIRISE);
-	iowrite32(0xff, gamepad_mem + OFF_GPIO_IEN);
+	/* Make room */
+	while ((slot = dac_clip_free_slot(&dac->bank)) < 0 || dac->bank.bytes + size > dac->bank.bytes_max) {
+		dac_clip_unload_slot(dac, dac_clip_victim(&dac->bank));
+		dac->bank.evictions++;
+	}
 
-	/* Allocate device number */
-	result = alloc_chrdev_region(&gamepad_dev, 1, 1, CDEV_GAMEPAD);
-	if (result < 0) return -1; // Failed to allocate device number
-	printk("Device number allocated: major %i, minor %i\n", MAJOR(gamepad_dev), MINOR(gamepad_dev));
+	spin_lock_bh(&dac->synth_lock);
+	load.id = dac_clip_insert(&dac->bank, slot, load.name, samples, load.count);
+	spin_unlock_bh(&dac->synth_lock);
 
-	/* Initialize cdev */
-	cdev_init(&gamepad_cdev, &gamepad_fops);
-	result = cdev_add(&gamepad_cdev, gamepad_dev, 1);
-	if (result < 0) return -1; // Failed to add cdev
+	if (copy_to_user(arg, &load, sizeof(load)) != 0) return -EFAULT;
 
-	/* Make visible in userspace */
-	gamepad_cl = class_create(THIS_MODULE, CDEV_GAMEPAD);
-	device_create(gamepad_cl, NULL, gamepad_dev, NULL, CDEV_GAMEPAD);
-	
 	return 0;
 }
 
-/* Disable gamepad hardware */
-static void gamepad_remove(void) {
-	/* Disable GPIO interrupt generation */
-	iowrite32(0x0, gamepad_mem + OFF_GPIO_IEN);
+/* Start a clip, only takes the spinlock so it can be called without waiting for writers */
+static long dac_clip_start(struct tdt4258_dac *dac, const struct dac_clip_play *play) {
+	long result;
 
-	/* Unregister interrupt handler */
-	free_irq(gamepad_irq_even, 0);
-	free_irq(gamepad_irq_odd, 0);
+	if (play->reserved[0] != 0 || play->reserved[1] != 0 || play->reserved[2] != 0) return -EINVAL;
 
-	/* Disable GPIO buttons */
-	iowrite32(0x0, gamepad_mem + OFF_GPIO_PC_MODEL);
+	spin_lock_bh(&dac->synth_lock);
+	if (dac->state.mode == DAC_MODE_PCM) {
+		result = -EBUSY; // The ring carries written samples
+	} else {
+		result = dac_clip_play(&dac->bank, &dac->synth, play->id, play->voice, play->volume);
+		dac_synth_update_playback(dac);
+	}
+	spin_unlock_bh(&dac->synth_lock);
 
-	/* Unmap memory region */
-	iounmap(gamepad_mem);
+	return result;
+}
 
-	/* Delete class */
-	device_destroy(gamepad_cl, gamepad_dev);
-	class_destroy(gamepad_cl);
+/* Set PCM sample format, written samples are resampled to the tone rate, called with dac->mutex held */
+static int dac_pcm_set_format(struct tdt4258_dac *dac, struct dac_pcm_format *format) {
+	if (format->bits != 8 && format->bits != 12) return -EINVAL;
+	if (format->channels != 1 && format->channels != 2) return -EINVAL;
+	if (format->rate < DAC_RESAMPLE_RATE_MIN || format->rate > DAC_RESAMPLE_RATE_MAX) return -EINVAL;
 
-	/* Delete cdev */
-	cdev_del(&gamepad_cdev);
+	/* Frames queued at the old rate are dropped */
+	dac->pcm.format = *format;
+	if (dac->state.mode == DAC_MODE_PCM) {
+		dac_reset(dac);
+	} else {
+		dac_resample_init(&dac->pcm.resampler, format->rate);
+	}
 
-	/* Free device number */
-	unregister_chrdev_region(gamepad_dev, 1);
+	return 0;
 }
 
+/* Number of free frames in the PCM ring */
+static unsigned int dac_pcm_space(struct tdt4258_dac *dac) {
+	return DAC_PCM_RING_SIZE - (dac->pcm.head - ACCESS_ONCE(dac->pcm.tail));
+}
 
-/* Start DAC playback */
-static void dac_start_playback(void) {
-	/* Disable GPIO interrupts during playback */
-	iowrite32(0, gamepad_mem + OFF_GPIO_IEN);
+/* Room for the output of at least one written frame */
+static bool dac_pcm_writable(struct tdt4258_dac *dac) {
+	return dac_pcm_space(dac) >= dac_resample_max_out(&dac->pcm.resampler);
+}
 
-	/* Enable DAC */
-	iowrite32(1, dac_mem + OFF_DAC0_CH0CTRL); // Disable channel 0
-	iowrite32(1, dac_mem + OFF_DAC0_CH1CTRL); // Disable channel 1
+/* Convert samples to frames at the tone rate and queue them, returns the number of samples consumed */
+static unsigned int dac_pcm_queue(struct tdt4258_dac *dac, const void *samples, unsigned int num) {
+	const unsigned int channels = dac->pcm.format.channels;
+	const unsigned int max_out = dac_resample_max_out(&dac->pcm.resampler);
+	const uint8_t *bytes = samples;
+	const uint16_t *words = samples;
+	unsigned int head = dac->pcm.head;
+	unsigned int space = dac_pcm_space(dac);
+	uint32_t left, right;
+	unsigned int i, out;
+
+	for (i = 0; i < num && space >= max_out; i++) {
+		/* Scale samples to 12 bits */
+		if (dac->pcm.format.bits == 8) {
+			left = bytes[i * channels] << 4;
+			right = bytes[i * channels + channels - 1] << 4;
+		} else {
+			left = words[i * channels] & 0xfff;
+			right = words[i * channels + channels - 1] & 0xfff;
+		}
 
-	/* Enable timer */
-	iowrite32(1, dac_timer_mem + OFF_TIMER_IEN); // Enable interrupt generation
-	iowrite32(0b1, dac_timer_mem + OFF_TIMER_CMD); // Send start command
-}
+		out = dac_resample_push(&dac->pcm.resampler, left, right,
+				dac->pcm.frames, DAC_PCM_RING_SIZE - 1, head);
+		head += out;
+		space -= out;
+	}
 
-/* Disable DAC playback */
-static void dac_stop_playback(void) {
-	/* Disable DAC */
-	iowrite32(0, dac_mem + OFF_DAC0_CH0CTRL); // Disable channel 0
-	iowrite32(0, dac_mem + OFF_DAC0_CH1CTRL); // Disable channel 1
+	smp_wmb(); // Write frames before moving head past them
+	dac->pcm.head = head;
 
-	/* Disable timer */
-	iowrite32(0, dac_timer_mem + OFF_TIMER_IEN); // Disable interrupt generation
-	iowrite32(0b01, dac_timer_mem + OFF_TIMER_CMD); // Send stop command
+	return i;
+}
 
-	/* Reenable GPIO interrupts when playback stops */
-	iowrite32(0xff, gamepad_mem + OFF_GPIO_IEN);
+/* Bytes in one written frame of the current format, called with dac->mutex held */
+static size_t dac_pcm_frame_size(struct tdt4258_dac *dac) {
+	return (dac->pcm.format.bits == 8 ? 1 : 2) * dac->pcm.format.channels;
 }
 
-/* Set DAC note frequency */
-static void dac_set_freq(uint32_t freq) {
-	const uint32_t clk = 14000000/128; // Timer clock after prescale
-	uint32_t period;
+/* Write PCM samples, called with dac->mutex held */
+static ssize_t dac_pcm_write(struct file *filp, const char __user *buff, size_t count) {
+	struct tdt4258_dac *dac = filp->private_data;
+	size_t frame_size = dac_pcm_frame_size(dac);
+	uint16_t chunk[64]; // Bounce buffer, holds 32 frames of the largest format
+	unsigned long flags;
+	size_t done = 0;
+	unsigned int num;
+
+	while (count - done >= frame_size) {
+		/* Wait until the ring is at most half full */
+		if (!dac_pcm_writable(dac)) {
+			if (done > 0 || (filp->f_flags & O_NONBLOCK)) break;
+
+			mutex_unlock(&dac->mutex);
+			if (wait_event_interruptible(dac->wq,
+					dac_pcm_space(dac) >= DAC_PCM_RING_SIZE / 2 || ACCESS_ONCE(dac->dead)) != 0) {
+				mutex_lock(&dac->mutex);
+				break;
+			}
+			mutex_lock(&dac->mutex);
+
+			/* The device may be gone, or the mode or format changed while the mutex was dropped */
+			if (dac->dead) return -ENODEV;
+			if (dac->state.mode != DAC_MODE_PCM) {
+				if (done == 0) return -EAGAIN;
+				break;
+			}
+			frame_size = dac_pcm_frame_size(dac);
+			continue;
+		}
 
-	/* Calculate new timer period */
-	period = clk/(freq/2);
+		/* Copy and queue one chunk */
+		num = min_t(size_t, (count - done) / frame_size, sizeof(chunk) / frame_size);
+		if (copy_from_user(chunk, buff + done, num * frame_size) != 0) {
+			if (done == 0) return -EFAULT;
+			break;
+		}
+		num = dac_pcm_queue(dac, chunk, num);
+		done += num * frame_size;
+
+		/* Start playback once there are frames, a downsampled frame may not have produced one */
+		if (dac->pcm.head == ACCESS_ONCE(dac->pcm.tail)) continue;
+		spin_lock_irqsave(&dac->lock, flags);
+		if (!dac->state.running) dac_start_playback(dac);
+		spin_unlock_irqrestore(&dac->lock, flags);
+	}
 
-	/* Set timer period */
-	iowrite32(period, dac_timer_mem + OFF_TIMER_TOP);
+	if (done == 0) {
+		if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+		if (count >= frame_size) return -ERESTARTSYS;
+	}
 
-	/* Start playback */
-	dac_start_playback();
+	return done;
 }
 
 /* User program opens the driver */
 static int dac_open(struct inode *inode, struct file *filp) {
+	struct tdt4258 *tdt;
+
 	printk("DAC open\n");
+
+	/* Keep the device until the file is closed */
+	tdt = tdt4258_get(inode, dac_devt);
+	if (tdt == NULL) return -ENODEV;
+
+	/* File operations find the DAC of this device through the file */
+	filp->private_data = &tdt->dac;
 	
 	return 0;
 }
@@ -292,6 +1917,8 @@ static int dac_open(struct inode *inode, struct file *filp) {
 static int dac_release(struct inode *inode, struct file *filp) {
 	printk("DAC close\n");
 
+	tdt4258_put(container_of((struct tdt4258_dac *)filp->private_data, struct tdt4258, dac));
+
 	return 0;
 }
 
@@ -302,139 +1929,932 @@ static ssize_t dac_read(struct file *filp, char __user *buff, size_t count, loff
 	return 0;
 }
 
-/* User program writes to the driver */
-static ssize_t dac_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp) {
+/* Write a frequency in tone mode */
+static ssize_t dac_tone_write(struct file *filp, const char __user *buff, size_t count) {
+	struct tdt4258_dac *dac = filp->private_data;
+	char text[16];
+	size_t length;
 	int result;
 	int freq;
 
 	if (count > 0) {
+		/* Copy frequency input, anything past the buffer is ignored */
+		length = min(count, sizeof(text) - 1);
+		if (copy_from_user(text, buff, length) != 0) return -EFAULT;
+		text[length] = '\0';
+
 		/* Parse frequency input */
-		result = sscanf(buff, "%d", &(freq));
-		if (result >= 0) {
-			if (freq > 0) {
-				dac_set_freq(freq);
-			} else {
-				dac_stop_playback();
+		result = sscanf(text, "%d", &(freq));
+		if (result == 1) {
+			/* Check the range before scaling to millihertz, which would overflow */
+			if (freq > DAC_SYNTH_RATE / 2 || dac_set_freq(dac, max(freq, 0) * 1000) != 0) {
+				printk("Frequency %i out of range\n", freq);
 			}
 		} else {
-			printk("Failed to parse frequency, error code %i\n", result);
+			printk("Failed to parse frequency\n");
 		}
 	}
 
 	return count;
 }
 
+/* Copy, check and apply a command batch, returns the number of bytes used */
+static ssize_t dac_cmd_run(struct tdt4258_dac *dac, const char __user *buff, size_t count) {
+	struct dac_cmd_header header;
+	struct dac_cmd *cmds;
+	size_t size;
+	unsigned int i;
+	int result = 0;
+
+	/* Check header */
+	if (count < sizeof(header)) return -EINVAL;
+	if (copy_from_user(&header, buff, sizeof(header)) != 0) return -EFAULT;
+	if (header.magic != DAC_CMD_MAGIC || header.version != DAC_CMD_VERSION) return -EINVAL;
+	if (header.count == 0 || header.count > DAC_CMD_MAX) return -EINVAL;
+	size = header.count * sizeof(struct dac_cmd);
+	if (count < sizeof(header) + size) return -EINVAL;
+
+	/* Copy and check all commands before applying any of them */
+	cmds = kmalloc(size, GFP_KERNEL);
+	if (cmds == NULL) return -ENOMEM;
+	if (copy_from_user(cmds, buff + sizeof(header), size) != 0) {
+		result = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < header.count && result == 0; i++) {
+		result = dac_cmd_check(&cmds[i]);
+	}
+	if (result != 0) goto out;
+
+	/* Apply the whole batch between two samples */
+	spin_lock_bh(&dac->synth_lock);
+	for (i = 0; i < header.count; i++) {
+		dac_cmd_apply(&dac->synth, &cmds[i]);
+	}
+	dac_synth_update_playback(dac);
+	spin_unlock_bh(&dac->synth_lock);
+
+out:
+	kfree(cmds);
+	return result != 0 ? result : sizeof(header) + size;
+}
+
+/* Write a whole score in sequencer mode */
+static ssize_t dac_seq_write(struct file *filp, const char __user *buff, size_t count) {
+	struct tdt4258_dac *dac = filp->private_data;
+	struct dac_seq_event *events = NULL;
+	struct dac_seq_header header;
+	size_t size;
+
+	/* Check header */
+	if (count < sizeof(header)) return -EINVAL;
+	if (copy_from_user(&header, buff, sizeof(header)) != 0) return -EFAULT;
+	if (header.magic != DAC_SEQ_MAGIC || header.count > DAC_SEQ_MAX_EVENTS) return -EINVAL;
+	size = header.count * sizeof(struct dac_seq_event);
+	if (count < sizeof(header) + size) return -EINVAL;
+
+	/* Copy and check events */
+	if (header.count > 0) {
+		events = kmalloc(size, GFP_KERNEL);
+		if (events == NULL) return -ENOMEM;
+		if (copy_from_user(events, buff + sizeof(header), size) != 0) {
+			kfree(events);
+			return -EFAULT;
+		}
+	}
+	if (dac_seq_check(events, header.count) != 0) {
+		kfree(events);
+		return -EINVAL;
+	}
+
+	/* Swap in the new score */
+	spin_lock_bh(&dac->synth_lock);
+	events = dac_seq_swap(&dac->seq, events, header.count, header.loop);
+	dac_synth_update_playback(dac);
+	spin_unlock_bh(&dac->synth_lock);
+	kfree(events);
+
+	return sizeof(header) + size;
+}
+
+/* User program writes to the driver */
+static ssize_t dac_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp) {
+	struct tdt4258_dac *dac = filp->private_data;
+	ssize_t result;
+	uint32_t magic;
+
+	if (mutex_lock_interruptible(&dac->mutex) != 0) return -ERESTARTSYS;
+
+	if (dac->dead) {
+		result = -ENODEV;
+	} else if (dac->state.mode == DAC_MODE_PCM) {
+		result = dac_pcm_write(filp, buff, count);
+	} else if (dac->state.mode == DAC_MODE_SEQUENCER) {
+		result = dac_seq_write(filp, buff, count);
+	} else if (count >= sizeof(uint32_t) && get_user(magic, (uint32_t __user *)buff) == 0 &&
+			magic == DAC_CMD_MAGIC) {
+		result = dac_cmd_run(dac, buff, count);
+	} else {
+		result = dac_tone_write(filp, buff, count);
+	}
+
+	mutex_unlock(&dac->mutex);
+
+	return result;
+}
+
+/* User program polls the driver for room to write */
+static unsigned int dac_poll(struct file *filp, poll_table *wait) {
+	struct tdt4258_dac *dac = filp->private_data;
+
+	poll_wait(filp, &dac->wq, wait);
+
+	if (ACCESS_ONCE(dac->dead)) return POLLERR | POLLHUP;
+	if (dac->state.mode != DAC_MODE_PCM || dac_pcm_space(dac) >= DAC_PCM_RING_SIZE / 2) {
+		return POLLOUT | POLLWRNORM;
+	}
+
+	return 0;
+}
+
+/* User program sends a control command to the driver */
+static long dac_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct tdt4258_dac *dac = filp->private_data;
+	struct dac_pcm_format format;
+	struct dac_voice_ctl voice;
+	struct dac_clip_info info;
+	struct dac_clip_play play;
+	struct dac_clip *clip;
+	struct dac_seq_pos pos;
+	long result = 0;
+
+	if (ACCESS_ONCE(dac->dead)) return -ENODEV;
+
+	/* Clips are started without waiting for writers holding the mutex */
+	if (cmd == DAC_IOC_CLIP_PLAY) {
+		if (copy_from_user(&play, (void __user *)arg, sizeof(play)) != 0) return -EFAULT;
+		return dac_clip_start(dac, &play);
+	}
+
+	if (mutex_lock_interruptible(&dac->mutex) != 0) return -ERESTARTSYS;
+	if (dac->dead) {
+		mutex_unlock(&dac->mutex);
+		return -ENODEV;
+	}
+
+	switch (cmd) {
+	case DAC_IOC_SET_MODE:
+		if (arg != DAC_MODE_TONE && arg != DAC_MODE_PCM && arg != DAC_MODE_SEQUENCER) {
+			result = -EINVAL;
+			break;
+		}
+		dac_reset(dac);
+		spin_lock_bh(&dac->synth_lock);
+		dac->state.mode = arg;
+		dac_synth_update_playback(dac);
+		spin_unlock_bh(&dac->synth_lock);
+		break;
+	case DAC_IOC_SET_FREQ:
+		result = dac_set_freq(dac, arg);
+		break;
+	case DAC_IOC_SET_WAVEFORM:
+		if (arg >= DAC_WAVE_COUNT) {
+			result = -EINVAL;
+			break;
+		}
+		ACCESS_ONCE(dac->synth.voices[0].wavetable) = dac_wavetables[arg];
+		break;
+	case DAC_IOC_SET_AMPLITUDE:
+		if (arg > 0xfff) {
+			result = -EINVAL;
+			break;
+		}
+		ACCESS_ONCE(dac->synth.voices[0].volume) = arg;
+		break;
+	case DAC_IOC_VOICE:
+		if (copy_from_user(&voice, (void __user *)arg, sizeof(voice)) != 0) {
+			result = -EFAULT;
+			break;
+		}
+		result = dac_synth_set_voice(dac, &voice);
+		break;
+	case DAC_IOC_SEQ_POS:
+		spin_lock_bh(&dac->synth_lock);
+		pos.event = dac->seq.next;
+		pos.loops = dac->seq.loops;
+		pos.samples = dac->seq.samples;
+		pos.playing = dac->seq.playing;
+		spin_unlock_bh(&dac->synth_lock);
+		if (copy_to_user((void __user *)arg, &pos, sizeof(pos)) != 0) result = -EFAULT;
+		break;
+	case DAC_IOC_COMMANDS:
+		/* The batch length is taken from its header */
+		result = dac_cmd_run(dac, (const char __user *)arg,
+				sizeof(struct dac_cmd_header) + DAC_CMD_MAX * sizeof(struct dac_cmd));
+		if (result > 0) result = 0;
+		break;
+	case DAC_IOC_SET_FORMAT:
+		if (copy_from_user(&format, (void __user *)arg, sizeof(format)) != 0) {
+			result = -EFAULT;
+			break;
+		}
+		result = dac_pcm_set_format(dac, &format);
+		if (result == 0 && copy_to_user((void __user *)arg, &format, sizeof(format)) != 0) {
+			result = -EFAULT;
+		}
+		break;
+	case DAC_IOC_UNDERRUNS:
+		result = put_user(ACCESS_ONCE(dac->pcm.underruns), (uint32_t __user *)arg);
+		break;
+	case DAC_IOC_CLIP_LOAD:
+		result = dac_clip_load(dac, (struct dac_clip_load __user *)arg);
+		break;
+	case DAC_IOC_CLIP_UNLOAD:
+		clip = arg <= 0xffff ? dac_clip_lookup(&dac->bank, arg) : NULL;
+		if (clip == NULL) {
+			result = -ENOENT;
+			break;
+		}
+		dac_clip_unload_slot(dac, clip - dac->bank.clips);
+		break;
+	case DAC_IOC_SET_BINDINGS:
+		result = dac_set_bindings(dac, (const void __user *)arg);
+		break;
+	case DAC_IOC_CLIP_INFO:
+		info.bytes = dac->bank.bytes;
+		info.bytes_max = dac->bank.bytes_max;
+		info.clips = dac->bank.count;
+		info.evictions = dac->bank.evictions;
+		info.plays = ACCESS_ONCE(dac->bank.plays);
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)) != 0) result = -EFAULT;
+		break;
+	default:
+		result = -ENOTTY;
+	}
+
+	mutex_unlock(&dac->mutex);
+
+	return result;
+}
+
 /* File operations struct for cdev */
 static struct file_operations dac_fops = {
 	.owner = THIS_MODULE,
 	.read = dac_read,
 	.write = dac_write,
+	.poll = dac_poll,
+	.unlocked_ioctl = dac_ioctl,
 	.open = dac_open,
 	.release = dac_release
 };
 
+/* Mix the bound voices onto a frame, called from interrupt context */
+static uint32_t dac_bound_tick(struct tdt4258_dac *dac, uint32_t frame) {
+	if ((ACCESS_ONCE(dac->bound.active) | ACCESS_ONCE(dac->bound.clips_active)) == 0) return frame;
+
+	spin_lock(&dac->lock);
+	frame = dac_core_overlay(frame, &dac->bound);
+	spin_unlock(&dac->lock);
+
+	return frame;
+}
+
+/* Play the next frame of the ring, written or rendered, called from interrupt context */
+static void dac_pcm_tick(struct tdt4258_dac *dac) {
+	const uint32_t silence = DAC_MIDPOINT | (DAC_MIDPOINT << 16);
+	unsigned int tail = dac->pcm.tail;
+	uint32_t frame;
+
+	/* Stop when the writer has not kept up or nothing more is left to play */
+	if (tail == ACCESS_ONCE(dac->pcm.head)) {
+		spin_lock(&dac->lock);
+		if (dac->state.mode == DAC_MODE_PCM) {
+			dac->pcm.underruns++;
+			dac_stop_playback(dac);
+		} else if (dac->render.idle) {
+			/* Bound voices keep playing over silence until they end */
+			if ((dac->bound.active | dac->bound.clips_active) == 0) dac_stop_playback(dac);
+			else hal_write(dac->mem, OFF_DAC0_COMBDATA, dac_core_overlay(silence, &dac->bound));
+		} else {
+			dac->debug.render_underruns++; // Keep going, the renderer is late
+			wake_up(&dac->render.wq);
+		}
+		spin_unlock(&dac->lock);
+		return;
+	}
+
+	/* Write both channels at once */
+	smp_rmb(); // Read head before the frame it covers
+	frame = dac->pcm.frames[tail & (DAC_PCM_RING_SIZE - 1)];
+	smp_mb(); // Finish reading frame before handing it back
+	dac->pcm.tail = tail + 1;
+	if (dac->state.mode != DAC_MODE_PCM) frame = dac_bound_tick(dac, frame);
+	hal_write(dac->mem, OFF_DAC0_COMBDATA, frame);
+
+	/* Wake up the renderer once a block has played, and writers once the ring is half empty */
+	if (dac->state.mode != DAC_MODE_PCM) {
+		if (ACCESS_ONCE(dac->pcm.head) - (tail + 1) == dac->render.block) wake_up(&dac->render.wq);
+	} else if (dac_pcm_space(dac) == DAC_PCM_RING_SIZE / 2) {
+		wake_up_interruptible(&dac->wq);
+	}
+}
+
 /* Interrupt handler */
 static irqreturn_t dac_timer_irq_handler(int irq, void *dev_id) {
-	/* Write sample to dac */
-	iowrite32(dac_state.high * dac_state.amplitude, dac_mem + OFF_DAC0_CH0DATA);
-	iowrite32(dac_state.high * dac_state.amplitude, dac_mem + OFF_DAC0_CH1DATA);
-	dac_state.high = !dac_state.high; // Toggle sample high state
+	struct tdt4258_dac *dac = dev_id;
+	uint32_t start = cycles_now();
+
+	/* Clear interrupt */
+	hal_write(dac->timer_mem, OFF_TIMER_IFC, 1);
+
+	/* Tones were rendered ahead, so every mode only plays the next frame */
+	dac_pcm_tick(dac);
+
+	/* The timer wrapped again while the sample was produced */
+	if (hal_read(dac->timer_mem, OFF_TIMER_IF) & 1) dac->debug.timer_overruns++;
+	stats_hist_add(&dac->debug.timer_cycles, cycles_now() - start);
+
+	return IRQ_HANDLED;
+}
+
+/* Mixer benchmark, cycles per sample for each number of active voices */
+#define DAC_BENCH_SAMPLES 256
+
+static ssize_t mix_bench_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct dac_voice voices[DAC_VOICES];
+	unsigned long flags;
+	uint32_t start, cycles;
+	ssize_t len = 0;
+	int num, i;
+
+	/* Voices at unrelated frequencies so table lookups differ */
+	for (i = 0; i < DAC_VOICES; i++) {
+		voices[i].phase = 0;
+		voices[i].step = dac_freq_step((220 + 110 * i) * 1000);
+		voices[i].wavetable = dac_wavetables[i % DAC_WAVE_COUNT];
+		voices[i].volume = 0xfff / DAC_VOICES;
+	}
+
+	for (num = 0; num <= DAC_VOICES; num++) {
+		local_irq_save(flags);
+		start = cycles_now();
+		for (i = 0; i < DAC_BENCH_SAMPLES; i++) {
+			dac_synth_mix(voices, (1 << num) - 1);
+		}
+		cycles = cycles_now() - start;
+		local_irq_restore(flags);
+
+		len += sprintf(buf + len, "%i %u\n", num, cycles / DAC_BENCH_SAMPLES);
+	}
+
+	return len;
+}
+static DEVICE_ATTR(mix_bench, S_IRUSR, mix_bench_show, NULL);
+
+/* Longest DAC interrupt handler run in CPU cycles, writing resets it */
+static ssize_t irq_max_cycles_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", max(ACCESS_ONCE(tdt->dac.debug.timer_cycles.max),
+			ACCESS_ONCE(tdt->dac.debug.dma_cycles.max)));
+}
+
+static ssize_t irq_max_cycles_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	ACCESS_ONCE(tdt->dac.debug.timer_cycles.max) = 0;
+	ACCESS_ONCE(tdt->dac.debug.dma_cycles.max) = 0;
+
+	return count;
+}
+static DEVICE_ATTR(irq_max_cycles, S_IRUGO | S_IWUSR, irq_max_cycles_show, irq_max_cycles_store);
+
+/* Samples the renderer produces at a time, bound sounds start within two blocks */
+static ssize_t render_block_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ACCESS_ONCE(tdt->dac.render.block));
+}
+
+static ssize_t render_block_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count) {
+	struct tdt4258 *tdt = dev_get_drvdata(dev);
+	unsigned int block;
+
+	if (kstrtouint(buf, 0, &block) != 0) return -EINVAL;
+	if (block < DAC_RENDER_MIN || block > DAC_RENDER_MAX) return -EINVAL;
+	ACCESS_ONCE(tdt->dac.render.block) = block;
+	wake_up(&tdt->dac.render.wq); // A larger block may be due right away
+
+	return count;
+}
+static DEVICE_ATTR(render_block, S_IRUGO | S_IWUSR, render_block_show, render_block_store);
+
+static struct attribute *dac_attrs[] = {
+	&dev_attr_mix_bench.attr,
+	&dev_attr_irq_max_cycles.attr,
+	&dev_attr_render_block.attr,
+	NULL
+};
+
+static const struct attribute_group dac_attr_group = {
+	.attrs = dac_attrs
+};
+
+/* DMA interrupt handler, runs each time a buffer half has been played */
+static irqreturn_t dac_dma_irq_handler(int irq, void *dev_id) {
+	struct tdt4258_dac *dac = dev_id;
+	uint32_t start = cycles_now();
+	unsigned int num = 0;
+	unsigned int taken;
+	int half;
 
 	/* Clear interrupt */
-	iowrite32(1, dac_timer_mem + OFF_TIMER_IFC);
+	hal_write(dac->dma.mem, OFF_DMA_IFC, 1);
+
+	/* Refill the halves that are done */
+	for (half = 0; half < 2; half++) {
+		if ((dac->dma.desc[half * DAC_DMA_ALT].ctrl & 0x7) == 0) {
+			taken = dac_dma_refill(dac, half);
+			if (taken < DAC_DMA_FRAMES && !dac->dma.starved) dac->pcm.underruns++;
+			num += taken;
+		}
+	}
+	hal_write(dac->dma.mem, OFF_DMA_CHENS, 1); // Restart channel if both halves ran out
+
+	/* Stop once a whole half has been played without new frames */
+	if (num == 0 && dac->dma.starved) {
+		spin_lock(&dac->lock);
+		dac_stop_playback(dac);
+		spin_unlock(&dac->lock);
+	}
+	dac->dma.starved = (num == 0);
+
+	/* Wake up writers once the ring is half empty */
+	if (dac_pcm_space(dac) >= DAC_PCM_RING_SIZE / 2) {
+		wake_up_interruptible(&dac->wq);
+	}
+
+	stats_hist_add(&dac->debug.dma_cycles, cycles_now() - start);
 
 	return IRQ_HANDLED;
 }
 
-static int dac_probe(struct platform_device *p_dev) {
+/* Set up DMA playback if the platform provides the DMA interrupt */
+static int dac_dma_probe(struct tdt4258_dac *dac, struct platform_device *p_dev) {
+	void *cmu_mem;
+	int result;
+
+	dac->dma.irq = platform_get_irq(p_dev, DAC_DMA_IRQ_NUM);
+	if (!use_dma || dac->dma.irq < 0) {
+		printk("DAC DMA disabled, using timer interrupt for samples\n");
+		return 0;
+	}
+	printk("DMA interrupt number: %i\n", dac->dma.irq);
+
+	/* Map memory regions */
+	dac->dma.mem = hal_map(DMA_BASE, 0x1200);
+	dac->dma.prs_mem = hal_map(PRS_BASE, 0x100);
+	cmu_mem = hal_map(CMU_BASE2, 0x100);
+	if (dac->dma.mem == NULL || dac->dma.prs_mem == NULL || cmu_mem == NULL) {
+		result = -ENOMEM;
+		goto out_unmap; // Failed to map registers
+	}
+
+	/* Enable DMA and PRS clocks */
+	hal_write(cmu_mem, OFF_CMU_HFCORECLKEN0, hal_read(cmu_mem, OFF_CMU_HFCORECLKEN0) | CMU_HFCORECLKEN0_DMA);
+	hal_write(cmu_mem, OFF_CMU_HFPERCLKEN0, hal_read(cmu_mem, OFF_CMU_HFPERCLKEN0) | CMU2_HFPERCLKEN0_PRS);
+	hal_unmap(cmu_mem);
+	cmu_mem = NULL;
+
+	/* Allocate descriptors and buffers */
+	dac->dma.desc = dma_alloc_coherent(&p_dev->dev, 2 * DAC_DMA_ALT * sizeof(struct dac_dma_desc),
+			&dac->dma.desc_phys, GFP_KERNEL);
+	dac->dma.buff = dma_alloc_coherent(&p_dev->dev, 2 * DAC_DMA_FRAMES * sizeof(uint32_t),
+			&dac->dma.buff_phys, GFP_KERNEL);
+	if (dac->dma.desc == NULL || dac->dma.buff == NULL) {
+		result = -ENOMEM;
+		goto out_free; // Failed to allocate DMA memory
+	}
+	memset(dac->dma.desc, 0, 2 * DAC_DMA_ALT * sizeof(struct dac_dma_desc));
+
+	/* Point both halves of channel 0 at the combined DAC data register */
+	dac->dma.desc[0].src_end = dac->dma.buff_phys + (DAC_DMA_FRAMES - 1) * sizeof(uint32_t);
+	dac->dma.desc[0].dst_end = dac->res->start + OFF_DAC0_COMBDATA;
+	dac->dma.desc[DAC_DMA_ALT].src_end = dac->dma.buff_phys + (2 * DAC_DMA_FRAMES - 1) * sizeof(uint32_t);
+	dac->dma.desc[DAC_DMA_ALT].dst_end = dac->res->start + OFF_DAC0_COMBDATA;
+
+	/* Configure DMA controller */
+	hal_write(dac->dma.mem, OFF_DMA_CONFIG, 1); // Enable controller
+	hal_write(dac->dma.mem, OFF_DMA_CTRLBASE, dac->dma.desc_phys);
+	hal_write(dac->dma.mem, OFF_DMA_CH0_CTRL, DAC_DMA_SOURCE);
+	hal_write(dac->dma.mem, OFF_DMA_CHUSEBURSTC, 1); // Single requests
+	hal_write(dac->dma.mem, OFF_DMA_REQMASKC, 1); // Accept requests
+
+	/* Route timer overflow to PRS channel 0 for the DAC */
+	hal_write(dac->dma.prs_mem, OFF_PRS_CH0_CTRL, DAC_DMA_PRS_SOURCE);
+
+	/* Register interrupt handler */
+	result = request_irq(dac->dma.irq, (irq_handler_t)dac_dma_irq_handler,
+			0, dac->name, dac);
+	if (result != 0) goto out_disable; // Failed to set up interrupts
+	hal_write(dac->dma.mem, OFF_DMA_IEN, 1); // Interrupt when channel 0 is done
+
+	dac->dma.enabled = true;
+
+	return 0;
+
+	/* Undo in reverse order */
+out_disable:
+	hal_write(dac->dma.mem, OFF_DMA_CONFIG, 0);
+out_free:
+	if (dac->dma.desc != NULL) {
+		dma_free_coherent(&p_dev->dev, 2 * DAC_DMA_ALT * sizeof(struct dac_dma_desc),
+				dac->dma.desc, dac->dma.desc_phys);
+	}
+	if (dac->dma.buff != NULL) {
+		dma_free_coherent(&p_dev->dev, 2 * DAC_DMA_FRAMES * sizeof(uint32_t),
+				dac->dma.buff, dac->dma.buff_phys);
+	}
+out_unmap:
+	if (cmu_mem != NULL) hal_unmap(cmu_mem);
+	if (dac->dma.prs_mem != NULL) hal_unmap(dac->dma.prs_mem);
+	if (dac->dma.mem != NULL) hal_unmap(dac->dma.mem);
+	return result;
+}
+
+/* Release DMA playback resources */
+static void dac_dma_remove(struct tdt4258_dac *dac, struct platform_device *p_dev) {
+	if (!dac->dma.enabled) return;
+
+	hal_write(dac->dma.mem, OFF_DMA_IEN, 0);
+	free_irq(dac->dma.irq, dac);
+
+	dma_free_coherent(&p_dev->dev, 2 * DAC_DMA_ALT * sizeof(struct dac_dma_desc),
+			dac->dma.desc, dac->dma.desc_phys);
+	dma_free_coherent(&p_dev->dev, 2 * DAC_DMA_FRAMES * sizeof(uint32_t),
+			dac->dma.buff, dac->dma.buff_phys);
+
+	hal_unmap(dac->dma.mem);
+	hal_unmap(dac->dma.prs_mem);
+}
+
+static int dac_probe(struct tdt4258 *tdt, struct platform_device *p_dev) {
+	struct sched_param param = { .sched_priority = DAC_RENDER_PRIORITY };
+	struct tdt4258_dac *dac = &tdt->dac;
 	int result;
+	int i;
+
+	/* Init locks and wait queues before anything can use them */
+	spin_lock_init(&dac->lock);
+	spin_lock_init(&dac->synth_lock);
+	mutex_init(&dac->mutex);
+	init_waitqueue_head(&dac->wq);
+	init_waitqueue_head(&dac->render.wq);
+	tdt4258_name(dac->name, sizeof(dac->name), CDEV_DAC, tdt->id);
 
 	/* Get platform info */
-	dac_res = platform_get_resource(p_dev, IORESOURCE_MEM, DAC_RESOURCE_NUM);
-	printk("DAC base addr: %x\n", dac_res->start);
-	dac_timer_res = platform_get_resource(p_dev, IORESOURCE_MEM, DAC_TIMER_RESOURCE_NUM);
-	printk("DAC sample timer base addr: %x\n", dac_timer_res->start);
-	dac_timer_irq = platform_get_irq(p_dev, 2);
-	printk("Timer interrupt number: %i\n", dac_timer_irq);
+	dac->res = platform_get_resource(p_dev, IORESOURCE_MEM, DAC_RESOURCE_NUM);
+	printk("DAC base addr: %x\n", dac->res->start);
+	dac->timer_res = platform_get_resource(p_dev, IORESOURCE_MEM, DAC_TIMER_RESOURCE_NUM);
+	printk("DAC sample timer base addr: %x\n", dac->timer_res->start);
+	dac->timer_irq = platform_get_irq(p_dev, 2);
+	printk("Timer interrupt number: %i\n", dac->timer_irq);
 
 	/* Map memory region */
-	dac_mem = ioremap_nocache(dac_res->start, dac_res->end - dac_res->start);
-	dac_timer_mem = ioremap_nocache(dac_timer_res->start, dac_timer_res->end - dac_timer_res->start);
+	dac->mem = hal_map(dac->res->start, dac->res->end - dac->res->start);
+	dac->timer_mem = hal_map(dac->timer_res->start, dac->timer_res->end - dac->timer_res->start);
+	if (dac->mem == NULL || dac->timer_mem == NULL) {
+		result = -ENOMEM;
+		goto out_unmap; // Failed to map registers
+	}
 
 	/* Configure DAC */
-	iowrite32(0x50010 | (0x01 << 2), dac_mem + OFF_DAC0_CTRL); // Set prescaler, sample and hold mode
-	dac_state.high = false;
-	dac_state.amplitude = 5;
+	hal_write(dac->mem, OFF_DAC0_CTRL, 0x50010 | (0x01 << 2)); // Set prescaler, sample and hold mode
+	dac_init_wavetables();
+	dac_init_notes();
+	for (i = 0; i < DAC_VOICES; i++) {
+		dac->synth.voices[i].wavetable = dac_wavetables[DAC_WAVE_SQUARE];
+		dac->synth.voices[i].volume = 5;
+	}
+	dac->state.mode = DAC_MODE_TONE;
+
+	/* Allocate PCM ring and set default format */
+	dac->pcm.frames = kmalloc(DAC_PCM_RING_SIZE * sizeof(*dac->pcm.frames), GFP_KERNEL);
+	if (dac->pcm.frames == NULL) {
+		result = -ENOMEM;
+		goto out_unmap; // Failed to allocate PCM ring
+	}
+	dac->pcm.format.rate = 8000;
+	dac->pcm.format.bits = 8;
+	dac->pcm.format.channels = 1;
+	dac_pcm_set_format(dac, &dac->pcm.format);
+	dac->bank.bytes_max = clip_kb * 1024;
+
+	/* Start tone renderer, real-time so the ring does not run dry under load */
+	dac->render.block = DAC_RENDER_BLOCK;
+	dac->render.idle = true;
+	dac->render.thread = kthread_run(dac_render_thread, dac, "%s-render", dac->name);
+	if (IS_ERR(dac->render.thread)) {
+		result = PTR_ERR(dac->render.thread);
+		goto out_ring; // Failed to start renderer
+	}
+	sched_setscheduler(dac->render.thread, SCHED_FIFO, &param);
 
 	/* Register interrupt handler */
-	result = request_irq(dac_timer_irq, (irq_handler_t)dac_timer_irq_handler,
-			0, CDEV_DAC, 0);
-	if (result != 0) return -1; // Failed to set up interrupts
+	result = request_irq(dac->timer_irq, (irq_handler_t)dac_timer_irq_handler,
+			0, dac->name, dac);
+	if (result != 0) goto out_thread; // Failed to set up interrupts
 
 	/* Configure sample timer */
-	iowrite32(ioread32(dac_timer_mem + OFF_TIMER_CTRL) | (7 << 24), dac_timer_mem + OFF_TIMER_CTRL); // Set HFPERCLK prescaler to divide by 128
+	hal_write(dac->timer_mem, OFF_TIMER_CTRL, hal_read(dac->timer_mem, OFF_TIMER_CTRL) | (7 << 24)); // Set HFPERCLK prescaler to divide by 128
+
+	hal_write(dac->timer_mem, OFF_TIMER_TOP, DAC_SYNTH_TOP); // Tone sample rate, PCM is resampled to it
+
+	/* Set up DMA playback */
+	result = dac_dma_probe(dac, p_dev);
+	if (result != 0) goto out_irq; // Failed to set up DMA
 
-	/* Allocate device number */
-	result = alloc_chrdev_region(&dac_dev, 1, 1, CDEV_DAC);
-	if (result < 0) return -1; // Failed to allocate device number
-	printk("Device number allocated: major %i, minor %i\n", MAJOR(dac_dev), MINOR(dac_dev));
+	/* Take the device number of this instance from the reserved range */
+	dac->dev = MKDEV(MAJOR(dac_devt), MINOR(dac_devt) + tdt->id);
+	printk("Device number allocated: major %i, minor %i\n", MAJOR(dac->dev), MINOR(dac->dev));
 
 	/* Initialize cdev */
-	cdev_init(&dac_cdev, &dac_fops);
-	result = cdev_add(&dac_cdev, dac_dev, 1);
-	if (result < 0) return -1; // Failed to add cdev
+	cdev_init(&dac->cdev, &dac_fops);
+	result = cdev_add(&dac->cdev, dac->dev, 1);
+	if (result < 0) goto out_dma; // Failed to add cdev
 
 	/* Make visible in userspace */
-	dac_cl = class_create(THIS_MODULE, CDEV_DAC);
-	device_create(dac_cl, NULL, dac_dev, NULL, CDEV_DAC);
+	dac->device = device_create(dac_cl, &p_dev->dev, dac->dev, tdt, "%s", dac->name);
+	if (IS_ERR(dac->device)) {
+		result = PTR_ERR(dac->device);
+		goto out_cdev; // Failed to create device node
+	}
+
+	/* Export benchmark */
+	result = sysfs_create_group(&dac->device->kobj, &dac_attr_group);
+	if (result < 0) goto out_device; // Failed to create attributes
 	
 	return 0;
+
+	/* Undo in reverse order */
+out_device:
+	device_destroy(dac_cl, dac->dev);
+out_cdev:
+	cdev_del(&dac->cdev);
+out_dma:
+	dac_dma_remove(dac, p_dev);
+out_irq:
+	free_irq(dac->timer_irq, dac);
+out_thread:
+	kthread_stop(dac->render.thread);
+out_ring:
+	kfree(dac->pcm.frames);
+	dac->pcm.frames = NULL;
+out_unmap:
+	if (dac->timer_mem != NULL) hal_unmap(dac->timer_mem);
+	if (dac->mem != NULL) hal_unmap(dac->mem);
+	return result;
 }
 
-static void dac_remove(void) {
+static void dac_remove(struct tdt4258_dac *dac, struct platform_device *p_dev) {
+	unsigned long flags;
+
+	/* Stop renderer first, it starts playback when it queues samples */
+	kthread_stop(dac->render.thread);
+
 	/* Stop DAC */
-	dac_stop_playback();
+	spin_lock_irqsave(&dac->lock, flags);
+	dac_stop_playback(dac);
+	spin_unlock_irqrestore(&dac->lock, flags);
 
-	/* Unregister interrupt handler */
-	free_irq(dac_timer_irq, 0);
+	/* Unregister interrupt handler, the buffers stay until the last file is closed */
+	free_irq(dac->timer_irq, dac);
+	dac_dma_remove(dac, p_dev);
 
 	/* Unmap memory region */
-	iounmap(dac_mem);
-	iounmap(dac_timer_mem);
+	hal_unmap(dac->mem);
+	hal_unmap(dac->timer_mem);
 
 	/* Delete class */
-	device_destroy(dac_cl, dac_dev);
-	class_destroy(dac_cl);
+	sysfs_remove_group(&dac->device->kobj, &dac_attr_group);
+	device_destroy(dac_cl, dac->dev);
 
 	/* Delete cdev */
-	cdev_del(&dac_cdev);
+	cdev_del(&dac->cdev);
+}
 
-	/* Free device number */
-	unregister_chrdev_region(dac_dev, 1);
+
+/////////////////////////////////////////////////
+//                   DEBUGFS                   //
+/////////////////////////////////////////////////
+
+/* Gamepad statistics */
+static int debug_gamepad_show(struct seq_file *m, void *data) {
+	struct tdt4258_gamepad *pad = m->private;
+
+	stats_hist_show(m, "irq_cycles", &pad->debug.irq_cycles);
+	stats_hist_show(m, "delivery_ns", &pad->debug.delivery_ns);
+	seq_printf(m, "dropped %u\n", pad->debug.dropped);
+	seq_printf(m, "latch_overruns %u\n", pad->stats.latch_overruns);
+	seq_printf(m, "signals %u\n", pad->debug.signals);
+	seq_printf(m, "signals_coalesced %u\n", pad->debug.signals_coalesced);
+	seq_printf(m, "signals_lost %u\n", pad->debug.signals_lost);
+
+	return 0;
+}
+
+static int debug_gamepad_open(struct inode *inode, struct file *filp) {
+	return single_open(filp, debug_gamepad_show, inode->i_private);
+}
+
+static const struct file_operations debug_gamepad_fops = {
+	.owner = THIS_MODULE,
+	.open = debug_gamepad_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/* DAC statistics */
+static int debug_dac_show(struct seq_file *m, void *data) {
+	struct tdt4258_dac *dac = m->private;
+
+	stats_hist_show(m, "timer_cycles", &dac->debug.timer_cycles);
+	stats_hist_show(m, "dma_cycles", &dac->debug.dma_cycles);
+	seq_printf(m, "timer_overruns %u\n", dac->debug.timer_overruns);
+	stats_hist_show(m, "render_cycles", &dac->debug.render_cycles);
+	stats_hist_show(m, "render_fill", &dac->debug.render_fill);
+	seq_printf(m, "render_underruns %u\n", dac->debug.render_underruns);
+	seq_printf(m, "underruns %u\n", dac->pcm.underruns);
+	seq_printf(m, "clip_bytes %u\n", dac->bank.bytes);
+	seq_printf(m, "clip_bytes_max %u\n", dac->bank.bytes_max);
+	seq_printf(m, "clips %u\n", dac->bank.count);
+	seq_printf(m, "clip_evictions %u\n", dac->bank.evictions);
+	seq_printf(m, "clip_plays %u\n", dac->bank.plays);
+
+	return 0;
+}
+
+static int debug_dac_open(struct inode *inode, struct file *filp) {
+	return single_open(filp, debug_dac_show, inode->i_private);
+}
+
+static const struct file_operations debug_dac_fops = {
+	.owner = THIS_MODULE,
+	.open = debug_dac_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * Writing anything clears the debugfs counters and histograms of both parts
+ * of a device. clip_plays is kept, it is the clock that picks clips to evict.
+ */
+static ssize_t debug_reset_write(struct file *filp, const char __user *buff, size_t count,
+		loff_t *offp) {
+	struct tdt4258 *tdt = filp->private_data;
+	unsigned long flags;
+
+	/* Evictions are counted by clip uploads, which hold the mutex */
+	if (mutex_lock_interruptible(&tdt->dac.mutex) != 0) return -ERESTARTSYS;
+	tdt->dac.bank.evictions = 0;
+
+	/* Keep readers, the tasklet and the interrupt handlers out while clearing */
+	spin_lock(&tdt->gamepad.debug_lock);
+	local_irq_save(flags);
+	memset(&tdt->gamepad.debug, 0, sizeof(tdt->gamepad.debug));
+	memset(&tdt->dac.debug, 0, sizeof(tdt->dac.debug));
+	tdt->gamepad.stats.latch_overruns = 0;
+	tdt->dac.pcm.underruns = 0;
+	local_irq_restore(flags);
+	spin_unlock(&tdt->gamepad.debug_lock);
+
+	mutex_unlock(&tdt->dac.mutex);
+
+	return count;
+}
+
+static const struct file_operations debug_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = debug_reset_write
+};
+
+/* Create the debugfs files of a device, statistics are still collected if this fails */
+static void debug_init(struct tdt4258 *tdt) {
+	char name[16];
+
+	if (tdt->id == 0) {
+		snprintf(name, sizeof(name), "tdt4258");
+	} else {
+		snprintf(name, sizeof(name), "tdt4258-%i", tdt->id);
+	}
+	tdt->debug_dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(tdt->debug_dir)) {
+		printk("Failed to create debugfs directory\n");
+		tdt->debug_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("gamepad", S_IRUGO, tdt->debug_dir, &tdt->gamepad, &debug_gamepad_fops);
+	debugfs_create_file("dac", S_IRUGO, tdt->debug_dir, &tdt->dac, &debug_dac_fops);
+	debugfs_create_file("reset", S_IWUSR, tdt->debug_dir, tdt, &debug_reset_fops);
+}
+
+/* Free the device once it is unbound and every file is closed */
+static void tdt4258_release(struct kref *ref) {
+	struct tdt4258 *tdt = container_of(ref, struct tdt4258, ref);
+	int slot;
+
+	free_page((unsigned long)tdt->gamepad.page);
+	kfree(tdt->dac.pcm.frames);
+	kfree(tdt->dac.seq.events);
+	for (slot = 0; slot < DAC_CLIP_MAX; slot++) {
+		kfree(tdt->dac.bank.clips[slot].samples);
+	}
+	kfree(tdt);
 }
 
 static int tdt4258_probe(struct platform_device *p_dev) {
+	struct tdt4258 *tdt;
 	int result;
 
 	printk("Device found for gamepad driver\n");
 
+	/* Allocate device state and pick the instance number */
+	tdt = kzalloc(sizeof(*tdt), GFP_KERNEL);
+	if (tdt == NULL) return -ENOMEM;
+	kref_init(&tdt->ref);
+	tdt->id = ida_simple_get(&tdt4258_ida, 0, TDT4258_MAX_DEVICES, GFP_KERNEL);
+	if (tdt->id < 0) {
+		result = tdt->id;
+		goto out_free; // No free instance number
+	}
+	platform_set_drvdata(p_dev, tdt);
+
+	/* Configure dac first, the gamepad tasklet starts sounds bound to buttons */
+	result = dac_probe(tdt, p_dev);
+	if (result != 0) goto out_id; // Failed to enable dac
+
 	/* Configure gamepad */
-	result = gamepad_probe(p_dev);
-	if (result != 0) return -1; // Failed to enable gamepad
+	result = gamepad_probe(tdt, p_dev);
+	if (result != 0) goto out_dac; // Failed to enable gamepad
 
-	/* Configure dac */
-	result = dac_probe(p_dev);
-	if (result != 0) return -1; // Failed to enable dac
+	debug_init(tdt);
+
+	/* Allow opening the nodes */
+	mutex_lock(&tdt4258_lock);
+	tdt4258_devices[tdt->id] = tdt;
+	mutex_unlock(&tdt4258_lock);
 	
 	return 0;
+
+	/* Undo in reverse order */
+out_dac:
+	dac_remove(&tdt->dac, p_dev);
+out_id:
+	ida_simple_remove(&tdt4258_ida, tdt->id);
+out_free:
+	platform_set_drvdata(p_dev, NULL);
+	tdt4258_put(tdt);
+	return result;
 }
 
 static int tdt4258_remove(struct platform_device *p_dev) {
+	struct tdt4258 *tdt = platform_get_drvdata(p_dev);
+	unsigned long flags;
+
+	/* Refuse new opens */
+	mutex_lock(&tdt4258_lock);
+	tdt4258_devices[tdt->id] = NULL;
+	mutex_unlock(&tdt4258_lock);
+
+	/* Fail the operations of open files and wake the ones waiting */
+	ACCESS_ONCE(tdt->gamepad.dead) = true;
+	wake_up_interruptible(&tdt->gamepad.wq);
+	wake_up_interruptible(&tdt->gamepad.gesture_wq);
+	mutex_lock(&tdt->dac.mutex);
+	spin_lock_irqsave(&tdt->dac.lock, flags);
+	tdt->dac.dead = true;
+	spin_unlock_irqrestore(&tdt->dac.lock, flags);
+	mutex_unlock(&tdt->dac.mutex);
+	wake_up_interruptible(&tdt->dac.wq);
+
+	debugfs_remove_recursive(tdt->debug_dir);
+
 	/* Disable gamepad */
-	gamepad_remove();
+	gamepad_remove(&tdt->gamepad);
 
 	/* Disable dac */
-	dac_remove();
+	dac_remove(&tdt->dac, p_dev);
+
+	ida_simple_remove(&tdt4258_ida, tdt->id);
+
+	/* Open files keep the memory until they are closed */
+	tdt4258_put(tdt);
 
 	return 0;
 }
@@ -461,20 +2881,55 @@ static struct platform_driver tdt4258_driver = {
  * This is the first of two exported functions to handle inserting this
  * code into a running kernel
  *
- * Returns 0 if successfull, otherwise -1
+ * Returns 0 if successfull, otherwise a negative error code
  */
 
 static int __init tdt4258_init(void)
 {
+	int result;
+
 	printk("Hello World, here is your module speaking\n");
 
-	/* Register platform driver */
-	platform_driver_register(&tdt4258_driver);
+	/* Reserve device numbers for all devices, probe takes the one of its instance */
+	result = alloc_chrdev_region(&gamepad_devt, 0, TDT4258_MAX_DEVICES, CDEV_GAMEPAD);
+	if (result < 0) return result; // Failed to allocate device numbers
+	result = alloc_chrdev_region(&dac_devt, 0, TDT4258_MAX_DEVICES, CDEV_DAC);
+	if (result < 0) goto out_gamepad_region; // Failed to allocate device numbers
+
+	/* Classes shared by the nodes of all devices */
+	gamepad_cl = class_create(THIS_MODULE, CDEV_GAMEPAD);
+	if (IS_ERR(gamepad_cl)) {
+		result = PTR_ERR(gamepad_cl);
+		goto out_dac_region; // Failed to create class
+	}
+	dac_cl = class_create(THIS_MODULE, CDEV_DAC);
+	if (IS_ERR(dac_cl)) {
+		result = PTR_ERR(dac_cl);
+		goto out_gamepad_class; // Failed to create class
+	}
+
+	/* Start cycle counter used for benchmarks and statistics */
+	result = cycles_init();
+	if (result != 0) goto out_dac_class; // Failed to map the counter
 
-	/* Init task mutex */
-	mutex_init(&gamepad_task_mutex);
+	/* Register platform driver */
+	result = platform_driver_register(&tdt4258_driver);
+	if (result != 0) goto out_cycles; // Failed to register driver
 
 	return 0;
+
+	/* Undo in reverse order */
+out_cycles:
+	hal_unmap(cycles_mem);
+out_dac_class:
+	class_destroy(dac_cl);
+out_gamepad_class:
+	class_destroy(gamepad_cl);
+out_dac_region:
+	unregister_chrdev_region(dac_devt, TDT4258_MAX_DEVICES);
+out_gamepad_region:
+	unregister_chrdev_region(gamepad_devt, TDT4258_MAX_DEVICES);
+	return result;
 }
 
 /*
@@ -490,6 +2945,14 @@ static void __exit tdt4258_cleanup(void)
 
 	 /* Unregister platform driver */
 	 platform_driver_unregister(&tdt4258_driver);
+
+	 /* Delete classes and free device numbers */
+	 class_destroy(gamepad_cl);
+	 class_destroy(dac_cl);
+	 unregister_chrdev_region(gamepad_devt, TDT4258_MAX_DEVICES);
+	 unregister_chrdev_region(dac_devt, TDT4258_MAX_DEVICES);
+
+	 hal_unmap(cycles_mem);
 }
 
 module_init(tdt4258_init);
@@ -0,0 +1,304 @@
+/*
+ * Userspace interface of the gamepad driver.
+ */
+
+#ifndef DRIVER_GAMEPAD_H
+#define DRIVER_GAMEPAD_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/////////////////////////////////////////////////
+//                   GAMEPAD                   //
+/////////////////////////////////////////////////
+
+/*
+ * Event record returned by read() on the gamepad device. Button states are
+ * raw pin levels of port C, a cleared bit means the button is held down.
+ */
+struct gamepad_event {
+	__u64 time; // Time of the change in nanoseconds (CLOCK_MONOTONIC)
+	__u32 seq; // Sequence number, a gap means events were dropped
+	__u8 prev; // Button state before the change
+	__u8 state; // Button state after the change
+	__u8 changed; // Bits that differ between prev and state
+	__u8 flags; // GAMEPAD_EVENT_* flags
+};
+
+/* Event flags */
+#define GAMEPAD_EVENT_OVERFLOW 0x01 // Events were dropped right before this one
+
+/*
+ * Read-only page that can be mapped from offset 0 of the gamepad device. It is
+ * updated on every input change, sample it with gamepad_shared_read().
+ */
+struct gamepad_shared {
+	__u32 seq; // Odd while the driver updates the page
+	__u8 state; // Current button state
+	__u8 reserved[3];
+	__u64 time; // Time of the last change in nanoseconds (CLOCK_MONOTONIC)
+	__u32 presses[8]; // Number of presses of each button
+};
+
+#ifndef __KERNEL__
+/* Take a consistent copy of the shared page */
+static inline void gamepad_shared_read(const volatile struct gamepad_shared *page,
+		struct gamepad_shared *copy) {
+	__u32 seq;
+
+	do {
+		/* Wait for the driver to finish any update in progress */
+		while ((seq = page->seq) & 1);
+		__sync_synchronize();
+		*copy = *(const struct gamepad_shared *)page;
+		__sync_synchronize();
+	} while (page->seq != seq);
+}
+#endif
+
+/*
+ * Gesture patterns, set on an open file with GAMEPAD_IOC_SET_GESTURES. Such a
+ * file is only woken up when a pattern matches and read() returns struct
+ * gamepad_match records instead of events. Button masks use the bit order of
+ * the button state, but a set bit means the button is pressed.
+ */
+#define GAMEPAD_GESTURE_MAX 16 // Patterns per file
+#define GAMEPAD_GESTURE_STEPS 8 // Steps of a sequence
+
+/* Pattern types */
+#define GAMEPAD_GESTURE_CHORD 0 // All buttons in mask down, pressed within timeout_ms if it is set
+#define GAMEPAD_GESTURE_SEQUENCE 1 // Steps pressed in order, at most timeout_ms apart if it is set
+#define GAMEPAD_GESTURE_LONG_PRESS 2 // All buttons in mask held down for timeout_ms
+
+struct gamepad_gesture {
+	__u8 type; // GAMEPAD_GESTURE_* type
+	__u8 id; // Reported in matches
+	__u8 mask; // Buttons of a chord or long press
+	__u8 count; // Number of steps of a sequence
+	__u32 timeout_ms; // Time limit, see the pattern types
+	__u8 steps[GAMEPAD_GESTURE_STEPS]; // Buttons of each sequence step, pressed together
+};
+
+struct gamepad_gestures {
+	__u32 count; // Number of patterns, 0 goes back to reading events
+	struct gamepad_gesture patterns[GAMEPAD_GESTURE_MAX];
+};
+
+/* Match record returned by read() once gesture patterns are set */
+struct gamepad_match {
+	__u64 time; // Time of the match in nanoseconds (CLOCK_MONOTONIC)
+	__u32 seq; // Sequence number, a gap means matches were dropped
+	__u8 id; // Id of the pattern that matched
+	__u8 type; // GAMEPAD_GESTURE_* type of the pattern
+	__u8 state; // Button state at the match
+	__u8 flags; // GAMEPAD_EVENT_OVERFLOW if matches were dropped right before
+};
+
+/*
+ * Realtime signals, enabled on an open file with GAMEPAD_IOC_SET_SIGNAL. The
+ * process making the call is sent signo with si_code SI_QUEUE and
+ * si_value.sival_int carrying the button state, the buttons changed since the
+ * previous signal and the low 16 bits of the number of input changes since
+ * signals were turned on, see the GAMEPAD_SIGNAL_* macros. Changes less than
+ * interval_us after the previous signal are folded into one signal sent when
+ * the interval is over, a sequence step larger than one tells how many.
+ */
+#define GAMEPAD_SIGNAL_INTERVAL_MAX 1000000 // Longest interval_us
+
+struct gamepad_signal {
+	__s32 signo; // Realtime signal to send, 0 turns signals off
+	__u32 interval_us; // Least time between two signals, 0 sends one per tasklet run
+};
+
+/* Fields of si_value.sival_int */
+#define GAMEPAD_SIGNAL_STATE(value) ((__u32)(value) & 0xff) // Button state
+#define GAMEPAD_SIGNAL_CHANGED(value) (((__u32)(value) >> 8) & 0xff) // Bits changed since the last signal
+#define GAMEPAD_SIGNAL_SEQ(value) ((__u32)(value) >> 16) // Input changes, low 16 bits
+
+/* ioctl commands */
+#define GAMEPAD_IOC_MAGIC 'g'
+#define GAMEPAD_IOC_DROPPED _IOR(GAMEPAD_IOC_MAGIC, 0, __u32) // Events or matches this file missed
+#define GAMEPAD_IOC_SET_GESTURES _IOW(GAMEPAD_IOC_MAGIC, 1, struct gamepad_gestures)
+#define GAMEPAD_IOC_SET_SIGNAL _IOW(GAMEPAD_IOC_MAGIC, 2, struct gamepad_signal)
+
+
+/////////////////////////////////////////////////
+//                     DAC                     //
+/////////////////////////////////////////////////
+
+/* Output modes */
+#define DAC_MODE_TONE 0 // write() takes a command batch, or a tone frequency in Hz as text
+#define DAC_MODE_PCM 1 // write() takes samples in the format set with DAC_IOC_SET_FORMAT
+#define DAC_MODE_SEQUENCER 2 // write() takes a whole score, a header followed by events
+
+/* Sample rate of tones and the sequencer */
+#define DAC_TONE_RATE 15625
+
+/* Tone waveforms */
+#define DAC_WAVE_SINE 0
+#define DAC_WAVE_SQUARE 1 // Default
+#define DAC_WAVE_TRIANGLE 2
+#define DAC_WAVE_SAW 3
+#define DAC_WAVE_COUNT 4
+
+/* Tone voices, voice 0 is the one controlled by text writes */
+#define DAC_VOICES 8
+
+/* Voice setting for DAC_IOC_VOICE */
+struct dac_voice_ctl {
+	__u32 freq; // Frequency in millihertz, 0 turns the voice off
+	__u16 volume; // Peak-to-peak level, 0 to 4095
+	__u8 voice; // Voice number, below DAC_VOICES
+	__u8 waveform; // DAC_WAVE_* value
+};
+
+/*
+ * Score written in sequencer mode. The header is followed by count events,
+ * each applied delay samples (at DAC_TONE_RATE) after the previous one.
+ */
+#define DAC_SEQ_MAGIC 0x51455344 // "DSEQ"
+#define DAC_SEQ_NO_LOOP 0xffff
+#define DAC_SEQ_MAX_EVENTS 4096
+
+struct dac_seq_header {
+	__u32 magic; // DAC_SEQ_MAGIC
+	__u16 count; // Number of events, 0 stops the sequencer
+	__u16 loop; // Event to continue from after the last one, or DAC_SEQ_NO_LOOP
+};
+
+struct dac_seq_event {
+	__u32 delay; // Samples to wait after the previous event
+	__u8 voice; // Voice number, below DAC_VOICES
+	__u8 note; // MIDI note number, 0 turns the voice off
+	__u8 volume; // Level, 255 is full scale
+	__u8 waveform; // DAC_WAVE_* value
+};
+
+/* Sequencer position for DAC_IOC_SEQ_POS */
+struct dac_seq_pos {
+	__u32 event; // Index of the next event
+	__u32 loops; // Times the score has looped
+	__u32 samples; // Samples played since the score was written
+	__u32 playing; // Non-zero while the score is playing
+};
+
+/*
+ * Command batch, written in tone mode or passed to DAC_IOC_COMMANDS. The
+ * header is followed by count commands, which are all checked before any of
+ * them is applied and then take effect on the same sample.
+ */
+#define DAC_CMD_MAGIC 0x444d4344 // "DCMD"
+#define DAC_CMD_VERSION 1
+#define DAC_CMD_MAX 256
+
+struct dac_cmd_header {
+	__u32 magic; // DAC_CMD_MAGIC
+	__u16 version; // DAC_CMD_VERSION
+	__u16 count; // Number of commands, at most DAC_CMD_MAX
+};
+
+/* Command operations */
+#define DAC_CMD_SET_FREQ 0 // Value is the frequency in millihertz, 0 stops the voice
+#define DAC_CMD_SET_AMPLITUDE 1 // Value is the peak-to-peak level, 0 to 4095
+#define DAC_CMD_SET_WAVEFORM 2 // Value is a DAC_WAVE_* value
+#define DAC_CMD_START 3 // Resume the voice at its last frequency
+#define DAC_CMD_STOP 4 // Silence the voice, its frequency is kept
+
+struct dac_cmd {
+	__u8 op; // DAC_CMD_* operation
+	__u8 voice; // Voice number, below DAC_VOICES
+	__u16 reserved; // Must be 0
+	__u32 value; // Operation argument
+};
+
+/*
+ * Sample format of PCM mode. 8-bit samples are unsigned bytes, 12-bit samples
+ * are unsigned 16-bit words in native byte order. Stereo samples are
+ * interleaved with the left channel first. Any rate in range is accepted and
+ * converted by the driver, the DAC always runs at DAC_TONE_RATE.
+ */
+struct dac_pcm_format {
+	__u32 rate; // Sample rate in Hz, 1000 to 48000, resampled to DAC_TONE_RATE
+	__u8 bits; // 8 or 12
+	__u8 channels; // 1 or 2
+	__u8 reserved[2];
+};
+
+/*
+ * Sound effect clips, uploaded once with DAC_IOC_CLIP_LOAD into a bank of
+ * bounded size and played in tone and sequencer mode by DAC_IOC_CLIP_PLAY.
+ * Samples are signed 16-bit mono at DAC_TONE_RATE. When the bank is full the
+ * least recently played clips are evicted to make room.
+ */
+#define DAC_CLIP_MAX 16 // Clips in the bank
+#define DAC_CLIP_NAME_LEN 16
+#define DAC_CLIP_VOICES 4 // Clips playing at the same time
+
+struct dac_clip_load {
+	char name[DAC_CLIP_NAME_LEN]; // Clip name, a clip with the same name is replaced
+	__u64 samples; // User address of the samples
+	__u32 count; // Number of samples
+	__u16 id; // Set to the id used to play the clip
+	__u16 reserved; // Must be 0
+};
+
+struct dac_clip_play {
+	__u16 id; // Clip id from DAC_IOC_CLIP_LOAD
+	__u16 volume; // Peak-to-peak level, 0 to 4095, 0 stops the clip voice
+	__u8 voice; // Clip voice, below DAC_CLIP_VOICES
+	__u8 reserved[3]; // Must be 0
+};
+
+/* Bank usage for DAC_IOC_CLIP_INFO */
+struct dac_clip_info {
+	__u32 bytes; // Memory used by clip samples
+	__u32 bytes_max; // Size of the bank, see the clip_kb module parameter
+	__u32 clips; // Clips in the bank
+	__u32 evictions; // Clips evicted to make room for others
+	__u32 plays; // Clips started
+};
+
+/*
+ * Sounds started by the driver itself on button edges, set with
+ * DAC_IOC_SET_BINDINGS. They play in tone and sequencer mode, without a round
+ * trip through userspace, on voices of their own that start on the next
+ * sample. Buttons are indexed by their bit in the button state.
+ */
+#define DAC_BIND_NONE 0 // Nothing happens on the edge
+#define DAC_BIND_TONE 1 // Play value millihertz on a tone voice
+#define DAC_BIND_CLIP 2 // Play clip id value on a clip voice
+#define DAC_BIND_STOP 3 // Silence a tone voice
+
+struct dac_binding {
+	__u8 type; // DAC_BIND_* type
+	__u8 voice; // Tone voice, or clip voice for DAC_BIND_CLIP
+	__u8 waveform; // DAC_WAVE_* value of a tone
+	__u8 reserved; // Must be 0
+	__u16 volume; // Peak-to-peak level, 0 to 4095
+	__u16 duration_ms; // Stop after this long, 0 plays until stopped or the clip ends
+	__u32 value; // Frequency in millihertz or clip id
+};
+
+struct dac_bindings {
+	struct dac_binding press[8]; // Started when a button goes down
+	struct dac_binding release[8]; // Started when a button goes up
+};
+
+/* ioctl commands */
+#define DAC_IOC_MAGIC 'd'
+#define DAC_IOC_SET_MODE _IO(DAC_IOC_MAGIC, 0) // Argument is a DAC_MODE_* value
+#define DAC_IOC_SET_FORMAT _IOWR(DAC_IOC_MAGIC, 1, struct dac_pcm_format)
+#define DAC_IOC_UNDERRUNS _IOR(DAC_IOC_MAGIC, 2, __u32) // Times PCM playback ran dry
+#define DAC_IOC_SET_FREQ _IO(DAC_IOC_MAGIC, 3) // Argument is the voice 0 frequency in millihertz
+#define DAC_IOC_SET_WAVEFORM _IO(DAC_IOC_MAGIC, 4) // Argument is the voice 0 DAC_WAVE_* value
+#define DAC_IOC_SET_AMPLITUDE _IO(DAC_IOC_MAGIC, 5) // Argument is the voice 0 level, 0 to 4095
+#define DAC_IOC_VOICE _IOW(DAC_IOC_MAGIC, 6, struct dac_voice_ctl)
+#define DAC_IOC_SEQ_POS _IOR(DAC_IOC_MAGIC, 7, struct dac_seq_pos)
+#define DAC_IOC_COMMANDS _IOW(DAC_IOC_MAGIC, 8, struct dac_cmd_header) // Header followed by commands
+#define DAC_IOC_CLIP_LOAD _IOWR(DAC_IOC_MAGIC, 9, struct dac_clip_load)
+#define DAC_IOC_CLIP_PLAY _IOW(DAC_IOC_MAGIC, 10, struct dac_clip_play)
+#define DAC_IOC_CLIP_UNLOAD _IO(DAC_IOC_MAGIC, 11) // Argument is the clip id
+#define DAC_IOC_CLIP_INFO _IOR(DAC_IOC_MAGIC, 12, struct dac_clip_info)
+#define DAC_IOC_SET_BINDINGS _IOW(DAC_IOC_MAGIC, 13, struct dac_bindings)
+
+#endif // DRIVER_GAMEPAD_H
@@ -136,6 +136,19 @@
 
 #define PRS_CH0_CTRL ((volatile uint32_t*)(PRS_BASE + 0x010))
 
+// DWT
+
+#define DWT_BASE 0xe0001000
+
+#define DWT_CTRL   ((volatile uint32_t*)(DWT_BASE + 0x000))
+#define DWT_CYCCNT ((volatile uint32_t*)(DWT_BASE + 0x004))
+
+#define DEMCR_BASE 0xe000edfc
+
+#define DEMCR ((volatile uint32_t*)DEMCR_BASE)
+
+#define DEMCR_TRCENA (1 << 24)
+
 // System Control Block
 
 #define SCR          ((volatile uint32_t*)0xe000ed10)
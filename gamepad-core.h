@@ -0,0 +1,612 @@
+/*
+ * Gamepad event logic: latching, debouncing and the event ring. It does not
+ * depend on the kernel, so the host simulation in sim/ builds the same code.
+ * Times are in nanoseconds on CLOCK_MONOTONIC.
+ */
+
+#ifndef GAMEPAD_CORE_H
+#define GAMEPAD_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <asm/errno.h>
+#else
+#include "kcompat.h"
+#endif
+
+#include "hal.h"
+#include "offsets.h"
+#include "driver-gamepad.h"
+
+/* Event ring buffer, filled by the driver and read by every open file */
+#define GAMEPAD_RING_SIZE 64 // Number of event records, must be a power of two
+
+/*
+ * Debouncer. By default a pin change is delivered once the pin has kept its
+ * new level for a whole window, every edge starts the window again, so a
+ * glitch shorter than the window is never seen. In leading-edge mode the
+ * first edge is delivered at once and further edges are ignored for a
+ * window, which is faster but reports a glitch as a press and a release.
+ */
+#define GAMEPAD_DEBOUNCE_US 5000 // Default debounce window
+
+/* Adaptive polling, above an edge rate the pins are sampled from a timer instead of interrupting */
+#define GAMEPAD_POLL_RATE 2000 // Default edges per second that start polling, 0 never polls
+#define GAMEPAD_POLL_US 1000 // Sampling period while polling
+#define GAMEPAD_POLL_WINDOW_NS 10000000 // Period the edge rate is measured over
+#define GAMEPAD_POLL_IDLE 50 // Samples in a row without a change before interrupts are used again
+
+struct gamepad_core {
+	uint8_t input; // Delivered button state
+
+	/* Debouncer */
+	uint32_t window_ns; // Length of the window
+	bool leading; // Deliver the first edge at once instead of the settled level
+	uint8_t raw; // Last latched pin levels
+	uint8_t locked; // Pins inside their window
+	uint64_t until[8]; // End of window for each locked pin
+	uint32_t raw_edges; // Edges seen on the pins
+	uint32_t suppressed_edges; // Edges ignored by the debouncer
+
+	/* Adaptive polling, only touched from hard interrupt context */
+	uint32_t poll_rate; // Edges per second that start polling
+	bool polling; // Interrupts are masked and the pins are sampled from a timer
+	uint64_t rate_start; // Start of the current rate window
+	uint32_t rate_edges; // Edges in the current rate window
+	uint8_t poll_din; // Last polled pin levels
+	unsigned int idle; // Polled samples in a row without a change
+	uint32_t poll_entries; // Switches from interrupts to polling
+	uint32_t poll_exits; // Switches from polling back to interrupts
+	uint32_t poll_samples; // Samples taken while polling
+
+	/* Event ring */
+	struct gamepad_event events[GAMEPAD_RING_SIZE];
+	unsigned int head; // Next record to write, only written by the producer
+	uint32_t seq; // Sequence number of the next event
+};
+
+/* Read position of one consumer of the event ring */
+struct gamepad_cursor {
+	unsigned int tail; // Next record to read from the ring
+	uint32_t dropped; // Number of events overwritten before they were read
+	bool overflow; // Set when events were dropped, cleared by the next read record
+};
+
+/* Start from the given button state with the default debounce window */
+static inline void gamepad_core_init(struct gamepad_core *core, uint8_t input) {
+	memset(core, 0, sizeof(*core));
+	core->input = input;
+	core->raw = input;
+	core->window_ns = GAMEPAD_DEBOUNCE_US * 1000;
+	core->poll_rate = GAMEPAD_POLL_RATE;
+}
+
+/* Read the pins and clear the interrupt, called from the interrupt handler */
+static inline void gamepad_core_latch(void *mem, uint8_t *din, uint8_t *flags) {
+	uint32_t pending;
+
+	*din = hal_read(mem, OFF_GPIO_PC_DIN);
+	pending = hal_read(mem, OFF_GPIO_IF);
+	hal_write(mem, OFF_GPIO_IFC, pending);
+	*flags = pending;
+}
+
+/* Store an input change in the event ring, overwriting the oldest record */
+static inline void gamepad_core_push(struct gamepad_core *core, uint8_t prev, uint8_t state,
+		uint64_t time) {
+	unsigned int head = core->head;
+	struct gamepad_event *event;
+
+	/* Fill in record */
+	event = &core->events[head & (GAMEPAD_RING_SIZE - 1)];
+	event->time = time;
+	event->seq = core->seq++;
+	event->prev = prev;
+	event->state = state;
+	event->changed = prev ^ state;
+	event->flags = 0;
+
+	/* Publish record */
+	smp_wmb(); // Write record before moving head past it
+	core->head = head + 1;
+}
+
+/* Change the delivered state, returns true if something changed */
+static inline bool gamepad_core_deliver(struct gamepad_core *core, uint8_t state, uint64_t time) {
+	uint8_t prev = core->input;
+
+	if (state == prev) return false;
+
+	core->input = state;
+	gamepad_core_push(core, prev, state, time);
+
+	return true;
+}
+
+/* Update the page shared with userspace after an input change */
+static inline void gamepad_core_page_update(struct gamepad_shared *page, uint8_t prev, uint8_t state,
+		uint64_t time) {
+	uint8_t pressed = prev & ~state; // Buttons are active low
+	int i;
+
+	page->seq++;
+	smp_wmb(); // Mark page as being updated before changing it
+
+	page->state = state;
+	page->time = time;
+	for (i = 0; i < 8; i++) {
+		if (pressed & (1 << i)) page->presses[i]++;
+	}
+
+	smp_wmb(); // Finish update before marking page as consistent
+	page->seq++;
+}
+
+/* Start the debounce window of pins that just changed */
+static inline void gamepad_core_lock(struct gamepad_core *core, uint8_t pins, uint64_t time) {
+	uint32_t window_ns = ACCESS_ONCE(core->window_ns);
+	int i;
+
+	if (window_ns == 0) return;
+
+	for (i = 0; i < 8; i++) {
+		if (pins & (1 << i)) core->until[i] = time + window_ns;
+	}
+	core->locked |= pins;
+}
+
+/* Run a latched sample through the debouncer, returns true if input changed */
+static inline bool gamepad_core_sample(struct gamepad_core *core, uint8_t din, uint8_t flags,
+		uint64_t time) {
+	uint8_t edges = (din ^ core->raw) | flags;
+	uint8_t changed;
+
+	core->raw = din;
+	core->raw_edges += hweight8(edges);
+	core->suppressed_edges += hweight8(edges & core->locked);
+
+	/* Without a window every change goes through */
+	if (ACCESS_ONCE(core->window_ns) == 0) {
+		core->locked = 0;
+		return gamepad_core_deliver(core, din, time);
+	}
+
+	/* Settled mode waits for the pins to stay put for a window from their last edge */
+	if (!ACCESS_ONCE(core->leading)) {
+		gamepad_core_lock(core, edges, time);
+		return false;
+	}
+
+	/* Pins outside their window change immediately */
+	changed = (din ^ core->input) & ~core->locked;
+	gamepad_core_lock(core, changed, time);
+
+	return gamepad_core_deliver(core, core->input ^ changed, time);
+}
+
+/* Close expired windows and deliver pins that settled on a new level */
+static inline bool gamepad_core_expire(struct gamepad_core *core, uint64_t now) {
+	uint8_t expired = 0;
+	uint8_t changed;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if ((core->locked & (1 << i)) && core->until[i] <= now) expired |= 1 << i;
+	}
+	core->locked &= ~expired;
+
+	/* A level delivered late in leading-edge mode counts as a new edge */
+	changed = (core->raw ^ core->input) & expired;
+	if (ACCESS_ONCE(core->leading)) gamepad_core_lock(core, changed, now);
+
+	return gamepad_core_deliver(core, core->input ^ changed, now);
+}
+
+/* Find the end of the earliest open window, returns false if none is open */
+static inline bool gamepad_core_next_expiry(const struct gamepad_core *core, uint64_t *next) {
+	bool found = false;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if ((core->locked & (1 << i)) && (!found || core->until[i] < *next)) {
+			*next = core->until[i];
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Count the edges of an interrupt, returns true if the edge rate is over the
+ * limit and the caller should mask the interrupts and start polling.
+ */
+static inline bool gamepad_core_rate(struct gamepad_core *core, uint8_t din, uint8_t flags,
+		uint64_t time) {
+	uint32_t rate = ACCESS_ONCE(core->poll_rate);
+
+	if (time - core->rate_start >= GAMEPAD_POLL_WINDOW_NS) {
+		core->rate_start = time;
+		core->rate_edges = 0;
+	}
+	core->rate_edges += hweight8(flags);
+
+	if (rate == 0 || core->rate_edges * (1000000000 / GAMEPAD_POLL_WINDOW_NS) <= rate) return false;
+
+	core->polling = true;
+	core->poll_din = din;
+	core->idle = 0;
+	core->poll_entries++;
+
+	return true;
+}
+
+/*
+ * Count a sample taken while polling, returns true once the pins have been
+ * quiet long enough and the caller should go back to interrupts.
+ */
+static inline bool gamepad_core_poll(struct gamepad_core *core, uint8_t din, uint64_t time) {
+	core->poll_samples++;
+
+	if (din != core->poll_din) {
+		core->poll_din = din;
+		core->idle = 0;
+		return false;
+	}
+	if (++core->idle < GAMEPAD_POLL_IDLE) return false;
+
+	core->polling = false;
+	core->rate_start = time;
+	core->rate_edges = 0;
+	core->poll_exits++;
+
+	return true;
+}
+
+/* Start a cursor after the events already in the ring */
+static inline void gamepad_cursor_init(const struct gamepad_core *core, struct gamepad_cursor *cursor) {
+	cursor->tail = ACCESS_ONCE(core->head);
+	cursor->dropped = 0;
+	cursor->overflow = false;
+}
+
+/* Check if a cursor has records to read */
+static inline bool gamepad_cursor_pending(const struct gamepad_core *core,
+		const struct gamepad_cursor *cursor) {
+	return ACCESS_ONCE(cursor->tail) != ACCESS_ONCE(core->head);
+}
+
+/* Move a cursor that fell behind to the oldest record still valid, returns the events lost */
+static inline uint32_t gamepad_cursor_skip(struct gamepad_cursor *cursor, unsigned int head) {
+	/* One slot less than the ring size, the record at head may be half written */
+	const unsigned int valid = GAMEPAD_RING_SIZE - 1;
+	uint32_t lost = 0;
+
+	if (head - cursor->tail > valid) {
+		lost = head - cursor->tail - valid;
+		cursor->dropped += lost;
+		cursor->overflow = true;
+		cursor->tail = head - valid;
+	}
+
+	return lost;
+}
+
+/*
+ * Copy up to max records at a cursor into buff without blocking the producer.
+ * Returns the number of valid records, which start at buff[*first], and sets
+ * lost to the events dropped on the way. The cursor is not advanced.
+ */
+static inline unsigned int gamepad_cursor_snapshot(const struct gamepad_core *core,
+		struct gamepad_cursor *cursor, struct gamepad_event *buff, unsigned int max,
+		unsigned int *first, uint32_t *lost) {
+	const size_t size = sizeof(struct gamepad_event);
+	unsigned int head, index, num, part;
+
+	head = ACCESS_ONCE(core->head);
+	smp_rmb(); // Read head before the records it covers
+	*lost = gamepad_cursor_skip(cursor, head);
+	num = min_t(unsigned int, head - cursor->tail, max);
+
+	/* Snapshot records, the second copy is only needed when the ring wraps */
+	index = cursor->tail & (GAMEPAD_RING_SIZE - 1);
+	part = min_t(unsigned int, num, GAMEPAD_RING_SIZE - index);
+	memcpy(buff, &core->events[index], part * size);
+	memcpy(buff + part, &core->events[0], (num - part) * size);
+
+	/* Discard the part of the snapshot that was overwritten while copying */
+	smp_rmb(); // Read records before checking head again
+	head = ACCESS_ONCE(core->head);
+	index = cursor->tail;
+	*lost += gamepad_cursor_skip(cursor, head);
+	*first = cursor->tail - index;
+	num -= min(num, *first);
+
+	/* Mark the first record if events were lost before it */
+	if (num > 0 && cursor->overflow) {
+		buff[*first].flags |= GAMEPAD_EVENT_OVERFLOW;
+		cursor->overflow = false;
+	}
+
+	return num;
+}
+
+/* Gesture matcher of one reader, matches are queued for the reader to read */
+#define GAMEPAD_MATCH_RING_SIZE 16 // Number of match records, must be a power of two
+
+struct gamepad_matcher {
+	struct gamepad_gesture patterns[GAMEPAD_GESTURE_MAX];
+	unsigned int count; // Number of patterns
+	uint8_t state; // Button state seen last
+	uint8_t step[GAMEPAD_GESTURE_MAX]; // Sequence steps matched, or 1 once a long press is done
+	uint64_t since[GAMEPAD_GESTURE_MAX]; // Time of the last sequence step or of the first button down
+
+	/* Match ring */
+	struct gamepad_match matches[GAMEPAD_MATCH_RING_SIZE];
+	unsigned int head; // Next match to write
+	unsigned int tail; // Next match to read
+	uint32_t seq; // Sequence number of the next match
+	uint32_t dropped; // Matches overwritten before they were read
+	bool overflow; // Set when matches were dropped, cleared by the next match read
+};
+
+/* Check uploaded patterns */
+static inline int gamepad_gestures_check(const struct gamepad_gestures *gestures) {
+	const struct gamepad_gesture *pattern;
+	unsigned int i, j;
+
+	if (gestures->count > GAMEPAD_GESTURE_MAX) return -EINVAL;
+
+	for (i = 0; i < gestures->count; i++) {
+		pattern = &gestures->patterns[i];
+		switch (pattern->type) {
+		case GAMEPAD_GESTURE_CHORD:
+			if (pattern->mask == 0) return -EINVAL;
+			break;
+		case GAMEPAD_GESTURE_LONG_PRESS:
+			if (pattern->mask == 0 || pattern->timeout_ms == 0) return -EINVAL;
+			break;
+		case GAMEPAD_GESTURE_SEQUENCE:
+			if (pattern->count == 0 || pattern->count > GAMEPAD_GESTURE_STEPS) return -EINVAL;
+			for (j = 0; j < pattern->count; j++) {
+				if (pattern->steps[j] == 0) return -EINVAL;
+			}
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* Replace the patterns of a matcher, starting from the given button state */
+static inline void gamepad_matcher_set(struct gamepad_matcher *matcher,
+		const struct gamepad_gestures *gestures, uint8_t state) {
+	unsigned int i;
+
+	memcpy(matcher->patterns, gestures->patterns, gestures->count * sizeof(struct gamepad_gesture));
+	matcher->count = gestures->count;
+	matcher->state = state;
+	memset(matcher->since, 0, sizeof(matcher->since));
+
+	/* Long presses only start timing when their buttons go down */
+	for (i = 0; i < matcher->count; i++) {
+		matcher->step[i] = matcher->patterns[i].type == GAMEPAD_GESTURE_LONG_PRESS;
+	}
+}
+
+/* Queue a match, overwriting the oldest if the reader fell behind */
+static inline void gamepad_matcher_fire(struct gamepad_matcher *matcher, unsigned int index,
+		uint64_t time) {
+	struct gamepad_match *match;
+
+	if (matcher->head - matcher->tail == GAMEPAD_MATCH_RING_SIZE) {
+		matcher->tail++;
+		matcher->dropped++;
+		matcher->overflow = true;
+	}
+
+	match = &matcher->matches[matcher->head++ & (GAMEPAD_MATCH_RING_SIZE - 1)];
+	match->time = time;
+	match->seq = matcher->seq++;
+	match->id = matcher->patterns[index].id;
+	match->type = matcher->patterns[index].type;
+	match->state = matcher->state;
+	match->flags = 0;
+}
+
+/* Complete long presses held until now, returns the number of matches */
+static inline unsigned int gamepad_matcher_expire(struct gamepad_matcher *matcher, uint64_t now) {
+	const struct gamepad_gesture *pattern;
+	uint8_t down = ~matcher->state;
+	unsigned int i, matches = 0;
+
+	for (i = 0; i < matcher->count; i++) {
+		pattern = &matcher->patterns[i];
+		if (pattern->type != GAMEPAD_GESTURE_LONG_PRESS || matcher->step[i] != 0) continue;
+		if ((down & pattern->mask) != pattern->mask) continue;
+
+		if (now - matcher->since[i] >= pattern->timeout_ms * 1000000ULL) {
+			matcher->step[i] = 1;
+			gamepad_matcher_fire(matcher, i, now);
+			matches++;
+		}
+	}
+
+	return matches;
+}
+
+/* Advance a sequence on newly pressed buttons, returns true when it completes */
+static inline bool gamepad_matcher_sequence(struct gamepad_matcher *matcher, unsigned int index,
+		uint8_t down, uint8_t pressed, uint64_t time) {
+	const struct gamepad_gesture *pattern = &matcher->patterns[index];
+	uint64_t timeout = pattern->timeout_ms * 1000000ULL;
+	uint8_t want;
+
+	/* Too slow, start over */
+	if (matcher->step[index] > 0 && timeout != 0 && time - matcher->since[index] > timeout) {
+		matcher->step[index] = 0;
+	}
+
+	/* A button outside the step starts over, it may begin the sequence again */
+	want = pattern->steps[matcher->step[index]];
+	if ((pressed & ~want) != 0) {
+		matcher->step[index] = 0;
+		want = pattern->steps[0];
+		if ((pressed & ~want) != 0) return false;
+	}
+
+	/* A step is taken once all its buttons are down */
+	if ((down & want) != want) return false;
+	matcher->since[index] = time;
+	if (++matcher->step[index] < pattern->count) return false;
+
+	matcher->step[index] = 0;
+	return true;
+}
+
+/* Run an input change through the patterns, returns the number of matches */
+static inline unsigned int gamepad_matcher_event(struct gamepad_matcher *matcher,
+		const struct gamepad_event *event) {
+	const struct gamepad_gesture *pattern;
+	uint8_t down, was, pressed;
+	unsigned int i, matches;
+	bool match;
+
+	/* Long presses that ran out before this change */
+	matches = gamepad_matcher_expire(matcher, event->time);
+
+	down = ~event->state;
+	was = ~matcher->state;
+	pressed = down & ~was;
+	matcher->state = event->state;
+
+	for (i = 0; i < matcher->count; i++) {
+		pattern = &matcher->patterns[i];
+		match = false;
+
+		switch (pattern->type) {
+		case GAMEPAD_GESTURE_CHORD:
+			/* Time the chord from its first button down */
+			if ((was & pattern->mask) == 0 && (down & pattern->mask) != 0) {
+				matcher->since[i] = event->time;
+			}
+			match = (down & pattern->mask) == pattern->mask && (was & pattern->mask) != pattern->mask &&
+					(pattern->timeout_ms == 0 ||
+					event->time - matcher->since[i] <= pattern->timeout_ms * 1000000ULL);
+			break;
+		case GAMEPAD_GESTURE_LONG_PRESS:
+			/* Start timing once all buttons are down, done once any is released */
+			if ((down & pattern->mask) == pattern->mask && (was & pattern->mask) != pattern->mask) {
+				matcher->since[i] = event->time;
+				matcher->step[i] = 0;
+			} else if ((down & pattern->mask) != pattern->mask) {
+				matcher->step[i] = 1;
+			}
+			break;
+		case GAMEPAD_GESTURE_SEQUENCE:
+			if (pressed != 0) match = gamepad_matcher_sequence(matcher, i, down, pressed, event->time);
+			break;
+		}
+
+		if (match) {
+			gamepad_matcher_fire(matcher, i, event->time);
+			matches++;
+		}
+	}
+
+	return matches;
+}
+
+/* Find when the earliest long press completes, returns false if none is being held */
+static inline bool gamepad_matcher_next_deadline(const struct gamepad_matcher *matcher,
+		uint64_t *next) {
+	const struct gamepad_gesture *pattern;
+	uint8_t down = ~matcher->state;
+	bool found = false;
+	uint64_t deadline;
+	unsigned int i;
+
+	for (i = 0; i < matcher->count; i++) {
+		pattern = &matcher->patterns[i];
+		if (pattern->type != GAMEPAD_GESTURE_LONG_PRESS || matcher->step[i] != 0) continue;
+		if ((down & pattern->mask) != pattern->mask) continue;
+
+		deadline = matcher->since[i] + pattern->timeout_ms * 1000000ULL;
+		if (!found || deadline < *next) {
+			*next = deadline;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/* Copy up to max queued matches into buff and remove them, returns the number copied */
+static inline unsigned int gamepad_matcher_take(struct gamepad_matcher *matcher,
+		struct gamepad_match *buff, unsigned int max) {
+	unsigned int num = 0;
+
+	while (num < max && matcher->tail != matcher->head) {
+		buff[num] = matcher->matches[matcher->tail++ & (GAMEPAD_MATCH_RING_SIZE - 1)];
+		if (num == 0 && matcher->overflow) {
+			buff[num].flags |= GAMEPAD_EVENT_OVERFLOW;
+			matcher->overflow = false;
+		}
+		num++;
+	}
+
+	return num;
+}
+
+/* Realtime signal of one reader, input changes are coalesced into a pending signal */
+struct gamepad_notifier {
+	uint64_t interval_ns; // Least time between two signals
+	uint64_t last_ns; // Time the last signal was sent
+	uint32_t changes; // Input changes seen, sent as the sequence number
+	uint8_t changed; // Buttons changed since the last signal
+	bool pending; // Changes are waiting to be signalled
+	bool sent; // A signal was sent, last_ns is valid
+};
+
+/* Start signalling with the given interval, nothing pending */
+static inline void gamepad_notifier_init(struct gamepad_notifier *notifier, uint64_t interval_ns) {
+	memset(notifier, 0, sizeof(*notifier));
+	notifier->interval_ns = interval_ns;
+}
+
+/* Note an input change, returns true if it was folded into a signal already pending */
+static inline bool gamepad_notifier_event(struct gamepad_notifier *notifier, uint8_t prev, uint8_t state) {
+	bool coalesced = notifier->pending;
+
+	notifier->changed |= prev ^ state;
+	notifier->changes++;
+	notifier->pending = true;
+
+	return coalesced;
+}
+
+/* Check if a pending signal can be sent now, or find when it can, returns true if it is due */
+static inline bool gamepad_notifier_due(const struct gamepad_notifier *notifier, uint64_t now,
+		uint64_t *next) {
+	if (!notifier->sent || now >= notifier->last_ns + notifier->interval_ns) return true;
+
+	*next = notifier->last_ns + notifier->interval_ns;
+	return false;
+}
+
+/* Take the pending signal, returns its si_value */
+static inline uint32_t gamepad_notifier_take(struct gamepad_notifier *notifier, uint8_t state, uint64_t now) {
+	uint32_t value = state | (notifier->changed << 8) | (notifier->changes << 16);
+
+	notifier->changed = 0;
+	notifier->pending = false;
+	notifier->sent = true;
+	notifier->last_ns = now;
+
+	return value;
+}
+
+#endif // GAMEPAD_CORE_H
@@ -0,0 +1,55 @@
+/*
+ * Register access of the driver. In the kernel the accessors are plain MMIO,
+ * host builds route them to the simulated register file in sim/.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <asm/io.h>
+
+/* Map a register block */
+static inline void *hal_map(unsigned long phys, unsigned long size) {
+	return ioremap_nocache(phys, size);
+}
+
+/* Unmap a register block */
+static inline void hal_unmap(void *mem) {
+	iounmap(mem);
+}
+
+/* Read the register at offset off of a mapped block */
+static inline uint32_t hal_read(void *mem, uint32_t off) {
+	return ioread32(mem + off);
+}
+
+/* Write the register at offset off of a mapped block */
+static inline void hal_write(void *mem, uint32_t off, uint32_t value) {
+	iowrite32(value, mem + off);
+}
+
+#else
+
+#include "sim.h"
+
+static inline void *hal_map(unsigned long phys, unsigned long size) {
+	return sim_map(phys, size);
+}
+
+static inline void hal_unmap(void *mem) {
+}
+
+static inline uint32_t hal_read(void *mem, uint32_t off) {
+	return sim_read(mem, off);
+}
+
+static inline void hal_write(void *mem, uint32_t off, uint32_t value) {
+	sim_write(mem, off, value);
+}
+
+#endif // __KERNEL__
+
+#endif // HAL_H
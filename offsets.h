@@ -58,6 +58,32 @@
 #define OFF_TIMER_CTRL          0x00
 #define OFF_TIMER_CMD           0x04
 #define OFF_TIMER_IEN           0x0c
+#define OFF_TIMER_IF            0x10
 #define OFF_TIMER_IFC           0x18
 #define OFF_TIMER_TOP           0x1c
 #define OFF_TIMER_CNT           0x24
+
+// DMA
+#define OFF_DMA_CONFIG          0x0004
+#define OFF_DMA_CTRLBASE        0x0008
+#define OFF_DMA_ALTCTRLBASE     0x000c
+#define OFF_DMA_CHUSEBURSTC     0x001c
+#define OFF_DMA_REQMASKC        0x0024
+#define OFF_DMA_CHENS           0x0028
+#define OFF_DMA_CHENC           0x002c
+#define OFF_DMA_CHALTC          0x0034
+#define OFF_DMA_IF              0x1000
+#define OFF_DMA_IFC             0x1008
+#define OFF_DMA_IEN             0x100c
+#define OFF_DMA_CH0_CTRL        0x1100
+
+// PRS
+#define OFF_PRS_CH0_CTRL        0x010
+
+// CMU
+#define OFF_CMU_HFCORECLKEN0    0x040
+#define OFF_CMU_HFPERCLKEN0     0x044
+
+// DWT
+#define OFF_DWT_CTRL            0x000
+#define OFF_DWT_CYCCNT          0x004
@@ -0,0 +1,543 @@
+/*
+ * Input benchmark. Replays synthetic button traces through the gamepad event
+ * path of the host build and measures the delay from each pin change until a
+ * consumer thread sees it, for every way the driver notifies programs:
+ *
+ *   read    blocking read, woken through a wait queue
+ *   poll    poll on a file descriptor, then read
+ *   signal    SIGUSR1, then read the current state
+ *   mmap      spinning on the shared page
+ *   rtsignal  queued realtime signal carrying the state, RTSIGNAL_INTERVAL_US apart
+ *   gesture   blocking read of gesture matches, a press and a long press of each button
+ *
+ * Prints one JSON object per trace and mode on stdout. Steps are the pin
+ * changes replayed, delivered the input changes left after debouncing and seen
+ * the ones the consumer got. Events overwritten in the ring count as dropped.
+ * Signal, mmap and rtsignal consumers only see the latest state, what they
+ * miss counts as coalesced. Realtime signals are timed from the last change
+ * they carry. In gesture mode delivered counts the matches instead of the
+ * changes. The flood trace runs without debouncing for the highest rate. The
+ * glitch traces are 0.5 ms pulses, which the default debouncer drops and the
+ * leading-edge one reports as a press and a release.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "driver.h"
+
+/* One step of a trace, pin levels of port C at an offset from the start */
+struct trace_step {
+	uint64_t offset_ns;
+	uint8_t din;
+};
+
+struct trace {
+	const char *name;
+	uint32_t debounce_ns; // Debounce window used while replaying
+	bool leading; // Leading-edge debouncing instead of settled levels only
+	uint32_t poll_rate; // Edge rate that starts polling
+	struct trace_step *steps;
+	unsigned int count;
+};
+
+enum mode { MODE_READ, MODE_POLL, MODE_SIGNAL, MODE_MMAP, MODE_RTSIGNAL, MODE_GESTURE, MODE_COUNT };
+static const char *mode_names[MODE_COUNT] = { "read", "poll", "signal", "mmap", "rtsignal", "gesture" };
+
+#define RTSIGNAL_INTERVAL_US 1000 // Signal interval of the rtsignal mode
+#define GESTURE_LONG_MS 10 // Hold time of the long press patterns
+
+/* Consumer side of a run */
+static struct {
+	enum mode mode;
+	volatile bool done; // Producer has finished and everything was delivered
+	pthread_t thread;
+	struct gamepad_cursor cursor;
+	uint64_t *latency; // Latency of each event seen
+	unsigned int seen; // Number of events seen
+	unsigned int capacity;
+	uint64_t last_ns; // Time the last event was seen
+	uint32_t dropped;
+	uint32_t page_seq; // Last page sequence number seen
+} consumer;
+
+/* Wait queue of the read mode */
+static pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wq_cond = PTHREAD_COND_INITIALIZER;
+
+/* File descriptor of the poll mode */
+static int poll_fd;
+
+/* Producer side of the rtsignal mode, times of the changes by their sequence number */
+static struct {
+	struct gamepad_notifier notifier;
+	uint64_t next; // Time a coalesced signal is due, UINT64_MAX if none
+	uint64_t times[1 << 16];
+	uint32_t lost; // Signals the queue did not take
+} rt;
+
+/* Matcher of the gesture mode, guarded by wq_lock */
+static struct gamepad_matcher matcher;
+static unsigned int gesture_tail; // Next event ring record to match
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t time) {
+	struct timespec ts = { time / 1000000000, time % 1000000000 };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+static void record(uint64_t time, uint64_t seen) {
+	if (consumer.seen < consumer.capacity) consumer.latency[consumer.seen] = seen - time;
+	consumer.seen++;
+	consumer.last_ns = seen;
+}
+
+/* Read all pending records, as gamepad_read does */
+static void consume_ring(void) {
+	static struct gamepad_event buff[GAMEPAD_RING_SIZE];
+	unsigned int num, first, i;
+	uint32_t lost;
+	uint64_t now;
+
+	while (gamepad_cursor_pending(&sim_gamepad, &consumer.cursor)) {
+		num = gamepad_cursor_snapshot(&sim_gamepad, &consumer.cursor, buff, GAMEPAD_RING_SIZE,
+				&first, &lost);
+		consumer.dropped += lost;
+		consumer.cursor.tail += num;
+
+		now = now_ns();
+		for (i = 0; i < num; i++) record(buff[first + i].time, now);
+	}
+}
+
+/* Read all queued matches, as gamepad_read does for a gesture reader */
+static void consume_matches(void) {
+	struct gamepad_match buff[GAMEPAD_MATCH_RING_SIZE];
+	unsigned int num, i;
+	uint64_t now;
+
+	pthread_mutex_lock(&wq_lock);
+	num = gamepad_matcher_take(&matcher, buff, GAMEPAD_MATCH_RING_SIZE);
+	consumer.dropped = matcher.dropped;
+	pthread_mutex_unlock(&wq_lock);
+
+	now = now_ns();
+	for (i = 0; i < num; i++) record(buff[i].time, now);
+}
+
+static void *consumer_fn(void *arg) {
+	struct gamepad_shared page;
+	struct pollfd pfd = { poll_fd, POLLIN, 0 };
+	struct timespec timeout = { 0, 10000000 };
+	uint64_t count;
+	siginfo_t info;
+	sigset_t set, rtset;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigemptyset(&rtset);
+	sigaddset(&rtset, SIGRTMIN);
+
+	while (!consumer.done) {
+		switch (consumer.mode) {
+		case MODE_READ:
+			pthread_mutex_lock(&wq_lock);
+			while (!consumer.done && !gamepad_cursor_pending(&sim_gamepad, &consumer.cursor)) {
+				pthread_cond_wait(&wq_cond, &wq_lock);
+			}
+			pthread_mutex_unlock(&wq_lock);
+			consume_ring();
+			break;
+		case MODE_POLL:
+			if (poll(&pfd, 1, 10) > 0 && read(poll_fd, &count, sizeof(count)) > 0) consume_ring();
+			break;
+		case MODE_SIGNAL:
+			/* The signal carries nothing, the program reads the current state */
+			if (sigtimedwait(&set, NULL, &timeout) == SIGUSR1 && !consumer.done) {
+				gamepad_shared_read(&sim_gamepad_page, &page);
+				record(page.time, now_ns());
+			}
+			break;
+		case MODE_MMAP:
+			/* One CPU is enough, so yield instead of spinning */
+			if (ACCESS_ONCE(sim_gamepad_page.seq) == consumer.page_seq) {
+				sched_yield();
+				break;
+			}
+			gamepad_shared_read(&sim_gamepad_page, &page);
+			consumer.page_seq = page.seq;
+			record(page.time, now_ns());
+			break;
+		case MODE_RTSIGNAL:
+			/* The value carries the state, no read needed */
+			if (sigtimedwait(&rtset, &info, &timeout) == SIGRTMIN && !consumer.done) {
+				record(rt.times[(GAMEPAD_SIGNAL_SEQ(info.si_value.sival_int) - 1) & 0xffff], now_ns());
+			}
+			break;
+		case MODE_GESTURE:
+			pthread_mutex_lock(&wq_lock);
+			while (!consumer.done && matcher.tail == matcher.head) {
+				pthread_cond_wait(&wq_cond, &wq_lock);
+			}
+			pthread_mutex_unlock(&wq_lock);
+			consume_matches();
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* Send the realtime signal if it is due, or note when it will be, as gamepad_notify does */
+static void rt_send(uint64_t now) {
+	union sigval value;
+
+	if (!rt.notifier.pending) return;
+	if (!gamepad_notifier_due(&rt.notifier, now, &rt.next)) return;
+
+	rt.next = UINT64_MAX;
+	value.sival_int = gamepad_notifier_take(&rt.notifier, sim_gamepad.input, now);
+	if (pthread_sigqueue(consumer.thread, SIGRTMIN, value) != 0) rt.lost++;
+}
+
+/* Match new events and completed long presses, returns true if a pattern matched */
+static bool gesture_match(uint64_t now) {
+	unsigned int head = sim_gamepad.head;
+	unsigned int matches = 0;
+
+	if (head - gesture_tail > GAMEPAD_RING_SIZE) gesture_tail = head - GAMEPAD_RING_SIZE;
+
+	pthread_mutex_lock(&wq_lock);
+	for (; gesture_tail != head; gesture_tail++) {
+		matches += gamepad_matcher_event(&matcher, &sim_gamepad.events[gesture_tail & (GAMEPAD_RING_SIZE - 1)]);
+	}
+	matches += gamepad_matcher_expire(&matcher, now);
+	pthread_mutex_unlock(&wq_lock);
+
+	return matches > 0;
+}
+
+/* Tell the consumer about new input, as the tasklet does */
+static void notify(uint8_t prev, uint64_t now) {
+	uint64_t one = 1;
+
+	switch (consumer.mode) {
+	case MODE_READ:
+		pthread_mutex_lock(&wq_lock);
+		pthread_cond_broadcast(&wq_cond);
+		pthread_mutex_unlock(&wq_lock);
+		break;
+	case MODE_POLL:
+		if (write(poll_fd, &one, sizeof(one)) < 0) perror("write");
+		break;
+	case MODE_SIGNAL:
+		pthread_kill(consumer.thread, SIGUSR1);
+		break;
+	case MODE_RTSIGNAL:
+		gamepad_notifier_event(&rt.notifier, prev, sim_gamepad.input);
+		rt.times[(rt.notifier.changes - 1) & 0xffff] = now;
+		rt_send(now);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Wake the gesture consumer once a pattern matched */
+static void gesture_notify(uint64_t now) {
+	if (!gesture_match(now)) return;
+
+	pthread_mutex_lock(&wq_lock);
+	pthread_cond_broadcast(&wq_cond);
+	pthread_mutex_unlock(&wq_lock);
+}
+
+/* Pass a delivered change on to the consumer, returns the number of changes delivered */
+static unsigned int deliver(uint8_t prev, uint64_t now) {
+	if (consumer.mode == MODE_GESTURE) {
+		gesture_notify(now);
+	} else {
+		notify(prev, now);
+	}
+
+	return 1;
+}
+
+/* Next run of the sampling timer while polling */
+static uint64_t poll_next;
+
+/* Timers of the event path */
+enum timer { TIMER_POLL, TIMER_DEBOUNCE, TIMER_SIGNAL, TIMER_GESTURE };
+
+/* Run the debounce, sampling, signal and long press timers that are due before a time */
+static unsigned int timers_until(uint64_t time) {
+	unsigned int delivered = 0;
+	uint64_t next, expiry = 0, now;
+	enum timer timer;
+	uint8_t prev;
+	bool changed;
+
+	for (;;) {
+		timer = TIMER_POLL;
+		next = sim_gamepad.polling ? poll_next : UINT64_MAX;
+		if (gamepad_core_next_expiry(&sim_gamepad, &expiry) && expiry < next) {
+			next = expiry;
+			timer = TIMER_DEBOUNCE;
+		}
+		if (rt.next < next) {
+			next = rt.next;
+			timer = TIMER_SIGNAL;
+		}
+		if (consumer.mode == MODE_GESTURE && gamepad_matcher_next_deadline(&matcher, &expiry) &&
+				expiry < next) {
+			next = expiry;
+			timer = TIMER_GESTURE;
+		}
+		if (next == UINT64_MAX || next > time) break;
+
+		sleep_until(next);
+		prev = sim_gamepad.input;
+		now = now_ns();
+		changed = false;
+		switch (timer) {
+		case TIMER_POLL:
+			poll_next += GAMEPAD_POLL_US * 1000;
+			changed = sim_gamepad_poll(now);
+			break;
+		case TIMER_DEBOUNCE:
+			changed = sim_gamepad_timer(now);
+			break;
+		case TIMER_SIGNAL:
+			rt_send(now);
+			break;
+		case TIMER_GESTURE:
+			gesture_notify(now);
+			break;
+		}
+		if (changed) delivered += deliver(prev, now);
+	}
+
+	return delivered;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(unsigned int num, unsigned int pct) {
+	if (num == 0) return 0;
+
+	return consumer.latency[(uint64_t)(num - 1) * pct / 100];
+}
+
+/* Replay a trace with one notification mode and print the result */
+static void run(const struct trace *trace, enum mode mode) {
+	struct gamepad_gestures gestures;
+	unsigned int delivered = 0;
+	unsigned int i, num;
+	uint64_t start, end, wait, now;
+	uint8_t prev;
+	double rate;
+
+	sim_driver_probe();
+	sim_gamepad_set_debounce(trace->debounce_ns);
+	sim_gamepad_set_leading(trace->leading);
+	sim_gamepad_set_poll_rate(trace->poll_rate);
+
+	memset(&consumer, 0, sizeof(consumer));
+	consumer.mode = mode;
+	consumer.capacity = trace->count + 1;
+	consumer.latency = calloc(consumer.capacity, sizeof(uint64_t));
+	gamepad_cursor_init(&sim_gamepad, &consumer.cursor);
+	consumer.page_seq = sim_gamepad_page.seq;
+
+	/* A press and a long press of each button for the gesture mode */
+	memset(&gestures, 0, sizeof(gestures));
+	for (i = 0; i < 8; i++) {
+		gestures.patterns[i].type = GAMEPAD_GESTURE_CHORD;
+		gestures.patterns[i].id = i;
+		gestures.patterns[i].mask = 1 << i;
+		gestures.patterns[8 + i].type = GAMEPAD_GESTURE_LONG_PRESS;
+		gestures.patterns[8 + i].id = 8 + i;
+		gestures.patterns[8 + i].mask = 1 << i;
+		gestures.patterns[8 + i].timeout_ms = GESTURE_LONG_MS;
+	}
+	gestures.count = 16;
+	memset(&matcher, 0, sizeof(matcher));
+	gamepad_matcher_set(&matcher, &gestures, sim_gamepad.input);
+	gesture_tail = sim_gamepad.head;
+
+	memset(&rt, 0, sizeof(rt));
+	gamepad_notifier_init(&rt.notifier, RTSIGNAL_INTERVAL_US * 1000);
+	rt.next = UINT64_MAX;
+
+	pthread_create(&consumer.thread, NULL, consumer_fn, NULL);
+
+	/* Replay pin changes, letting debounce windows run out in between */
+	start = now_ns() + 1000000; // Let the consumer start waiting
+	sleep_until(start);
+	for (i = 0; i < trace->count; i++) {
+		delivered += timers_until(start + trace->steps[i].offset_ns);
+		if (trace->steps[i].offset_ns > 0) sleep_until(start + trace->steps[i].offset_ns);
+
+		/* Pin interrupts are masked while polling */
+		if (!sim_gpio_set(trace->steps[i].din)) continue;
+		prev = sim_gamepad.input;
+		now = now_ns();
+		if (sim_gamepad_irq(now)) delivered += deliver(prev, now);
+		if (sim_gamepad.polling) poll_next = now + GAMEPAD_POLL_US * 1000;
+	}
+	delivered += timers_until(UINT64_MAX);
+	end = now_ns();
+
+	/* Gesture consumers are woken by matches, not changes */
+	if (mode == MODE_GESTURE) delivered = matcher.seq;
+
+	/* Give the consumer time to see the last events */
+	for (wait = 0; wait < 100 && consumer.seen < delivered; wait++) {
+		sleep_until(now_ns() + 1000000);
+	}
+	consumer.done = true;
+	pthread_mutex_lock(&wq_lock);
+	pthread_cond_broadcast(&wq_cond);
+	pthread_mutex_unlock(&wq_lock);
+	pthread_join(consumer.thread, NULL);
+	if (mode == MODE_RTSIGNAL) consumer.dropped = rt.lost;
+	if (mode == MODE_GESTURE) consumer.dropped = matcher.dropped;
+
+	/* Report */
+	num = min(consumer.seen, consumer.capacity);
+	qsort(consumer.latency, num, sizeof(uint64_t), compare_u64);
+	if (consumer.last_ns > start) end = max(end, consumer.last_ns);
+	rate = (double)consumer.seen * 1e9 / (double)(end - start);
+
+	printf("{\"bench\": \"input\", \"trace\": \"%s\", \"mode\": \"%s\", \"steps\": %u, "
+			"\"delivered\": %u, \"seen\": %u, \"dropped\": %u, \"coalesced\": %u, "
+			"\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+			"\"events_per_s\": %.0f, \"poll_entries\": %u}\n",
+			trace->name, mode_names[mode], trace->count, delivered, consumer.seen,
+			consumer.dropped, delivered - min(delivered, consumer.seen + consumer.dropped),
+			(unsigned long long)percentile(num, 50),
+			(unsigned long long)percentile(num, 90), (unsigned long long)percentile(num, 99),
+			(unsigned long long)percentile(num, 100), rate, sim_gamepad.poll_entries);
+	fflush(stdout);
+
+	free(consumer.latency);
+}
+
+/* Add a step to a trace being built */
+static void trace_add(struct trace *trace, uint64_t offset_ns, uint8_t din) {
+	trace->steps[trace->count].offset_ns = offset_ns;
+	trace->steps[trace->count].din = din;
+	trace->count++;
+}
+
+static int compare_steps(const void *a, const void *b) {
+	const struct trace_step *x = a, *y = b;
+
+	return x->offset_ns < y->offset_ns ? -1 : x->offset_ns > y->offset_ns;
+}
+
+/*
+ * Taps on the buttons in turn, each pressed for hold_ns. Every edge is
+ * followed by bounces extra toggles bounce_ns apart.
+ */
+static void trace_taps(struct trace *trace, unsigned int taps, uint64_t period_ns, uint64_t hold_ns,
+		unsigned int bounces, uint64_t bounce_ns) {
+	unsigned int tap, b, i;
+	uint8_t pin, level, din = 0xff;
+	uint64_t time;
+
+	/* Collect the changes of each pin as pin number and level in bit 7 */
+	trace->steps = calloc(taps * 2 * (bounces + 2), sizeof(struct trace_step));
+	for (tap = 0; tap < taps; tap++) {
+		pin = tap % 8;
+		for (level = 0; level < 2; level++) {
+			time = tap * period_ns + level * hold_ns;
+			for (b = 0; b <= bounces; b++) {
+				trace_add(trace, time + b * bounce_ns, pin | (level ^ (b % 2)) << 7);
+			}
+			if (bounces % 2) trace_add(trace, time + (bounces + 1) * bounce_ns, pin | level << 7);
+		}
+	}
+
+	/* Order the changes in time and turn them into port levels, pins are active low */
+	qsort(trace->steps, trace->count, sizeof(struct trace_step), compare_steps);
+	for (i = 0; i < trace->count; i++) {
+		pin = 1 << (trace->steps[i].din & 7);
+		din = trace->steps[i].din & 0x80 ? din | pin : din & ~pin;
+		trace->steps[i].din = din;
+	}
+}
+
+/* Back to back toggles of one pin with debouncing off, for the highest event rate */
+static void trace_flood(struct trace *trace, unsigned int edges) {
+	unsigned int i;
+
+	trace->steps = calloc(edges, sizeof(struct trace_step));
+	for (i = 0; i < edges; i++) trace_add(trace, 0, i % 2 ? 0xff : 0xfe);
+}
+
+#define TRACE_COUNT 7
+
+int main(int argc, char **argv) {
+	struct trace traces[TRACE_COUNT] = {
+		{ .name = "slow_taps", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .poll_rate = GAMEPAD_POLL_RATE },
+		{ .name = "fast_taps", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .poll_rate = GAMEPAD_POLL_RATE },
+		{ .name = "bounce_storm", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .poll_rate = GAMEPAD_POLL_RATE },
+		{ .name = "noisy_cable", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .poll_rate = GAMEPAD_POLL_RATE },
+		{ .name = "flood", .debounce_ns = 0, .poll_rate = 0 }, // Interrupt path only, polling would cap the rate
+		{ .name = "glitches", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .poll_rate = GAMEPAD_POLL_RATE },
+		{ .name = "glitches_leading", .debounce_ns = GAMEPAD_DEBOUNCE_US * 1000, .leading = true,
+				.poll_rate = GAMEPAD_POLL_RATE },
+	};
+	unsigned int t;
+	sigset_t set;
+	int mode;
+
+	trace_taps(&traces[0], 40, 40000000, 20000000, 0, 0);
+	trace_taps(&traces[1], 400, 1500000, 6000000, 0, 0);
+	trace_taps(&traces[2], 100, 12000000, 6000000, 9, 20000);
+	trace_taps(&traces[3], 50, 20000000, 10000000, 39, 25000);
+	trace_flood(&traces[4], 100000);
+	trace_taps(&traces[5], 40, 20000000, 500000, 0, 0);
+	trace_taps(&traces[6], 40, 20000000, 500000, 0, 0);
+
+	/* SIGUSR1 and the realtime signal are only taken with sigtimedwait */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGRTMIN);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	poll_fd = eventfd(0, EFD_NONBLOCK);
+
+	for (t = 0; t < TRACE_COUNT; t++) {
+		if (argc > 1 && strcmp(argv[1], traces[t].name) != 0) continue;
+		for (mode = 0; mode < MODE_COUNT; mode++) run(&traces[t], mode);
+		free(traces[t].steps);
+	}
+
+	close(poll_fd);
+
+	return 0;
+}
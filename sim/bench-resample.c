@@ -0,0 +1,90 @@
+/*
+ * Resampler benchmark. Converts test tones at the common asset rates to the
+ * tone rate with the PCM rate converter of dac-core.h and compares the result
+ * with the ideal tone sampled at the output rate.
+ *
+ * Prints one JSON object per input rate and tone on stdout. snr_db and
+ * max_err (in DAC steps) include the 12-bit quantization of the input.
+ * frames_out must equal expected_out, the converter keeps the exact ratio.
+ * ns_per_frame is the host time per output frame and realtime_x how many
+ * times faster than playback that is.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "driver.h"
+
+#define SECONDS 4 // Length of each converted tone
+#define SETTLE 32 // Output frames skipped while the converter starts from the midpoint
+#define AMPLITUDE 2000.0 // Peak of the test tones in DAC steps
+
+static const uint32_t rates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000 };
+static const double tones[] = { 440.0, 1000.0, 3000.0 };
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Tone sample at time t in seconds */
+static double tone(double freq, double t) {
+	return DAC_MIDPOINT + AMPLITUDE * sin(2.0 * M_PI * freq * t);
+}
+
+static void run(uint32_t rate, double freq) {
+	const unsigned int in_count = rate * SECONDS;
+	const unsigned int expected = DAC_SYNTH_RATE * SECONDS;
+	struct dac_resampler rs;
+	uint32_t *in, *out;
+	double signal = 0, noise = 0, err, max_err = 0, ideal;
+	uint64_t start, elapsed;
+	unsigned int head = 0, i;
+
+	/* Input quantized to 12 bits, as written to the device */
+	in = malloc(in_count * sizeof(*in));
+	out = malloc((expected + 64) * sizeof(*out));
+	for (i = 0; i < in_count; i++) in[i] = lrint(tone(freq, (double)i / rate));
+
+	dac_resample_init(&rs, rate);
+	start = now_ns();
+	for (i = 0; i < in_count; i++) head += dac_resample_push(&rs, in[i], in[i], out, ~0u, head);
+	elapsed = now_ns() - start;
+
+	/* Output frame k lies two input frames behind time k / DAC_SYNTH_RATE */
+	for (i = SETTLE; i < head; i++) {
+		ideal = tone(freq, (double)i / DAC_SYNTH_RATE - 2.0 / rate);
+		err = (double)(out[i] & 0xfff) - ideal;
+		signal += (ideal - DAC_MIDPOINT) * (ideal - DAC_MIDPOINT);
+		noise += err * err;
+		if (fabs(err) > max_err) max_err = fabs(err);
+	}
+
+	printf("{\"bench\": \"resample\", \"rate\": %u, \"tone_hz\": %.0f, \"frames_in\": %u, "
+			"\"frames_out\": %u, \"expected_out\": %u, \"snr_db\": %.1f, \"max_err\": %.2f, "
+			"\"ns_per_frame\": %.2f, \"realtime_x\": %.0f}\n",
+			rate, freq, in_count, head, expected, 10.0 * log10(signal / noise), max_err,
+			(double)elapsed / head, 1e9 / DAC_SYNTH_RATE / ((double)elapsed / head));
+	fflush(stdout);
+
+	free(in);
+	free(out);
+}
+
+int main(void) {
+	unsigned int r, t;
+
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		for (t = 0; t < sizeof(tones) / sizeof(tones[0]); t++) {
+			if (tones[t] < rates[r] / 2) run(rates[r], tones[t]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Host build of the driver core.
+ */
+
+#include "driver.h"
+#include "efm32gg.h"
+
+struct gamepad_core sim_gamepad;
+struct gamepad_shared sim_gamepad_page;
+struct dac_synth sim_synth;
+struct dac_seq sim_seq;
+
+/* Tables of the synthesizer, declared in dac-core.h */
+int16_t dac_wavetables[DAC_WAVE_COUNT][WAVETABLE_SIZE];
+uint32_t dac_note_steps[128];
+
+/* Mapped register blocks */
+static void *sim_gamepad_mem;
+static void *sim_dac_mem;
+static void *sim_timer_mem;
+
+/* Frames rendered ahead of the timer interrupt, one block at a time */
+static struct {
+	uint32_t frames[DAC_RENDER_BLOCK];
+	unsigned int head;
+	unsigned int tail;
+} sim_render;
+
+void sim_driver_probe(void) {
+	int i;
+
+	sim_reset();
+
+	/* Configure GPIO buttons like gamepad_probe */
+	sim_gamepad_mem = hal_map(GPIO_PA_BASE, 0x200);
+	hal_write(sim_gamepad_mem, OFF_GPIO_PC_MODEL, 0x33333333);
+	hal_write(sim_gamepad_mem, OFF_GPIO_PC_DOUT, 0xFF);
+	sim_gpio_set(0xff); // Buttons are active low
+	hal_write(sim_gamepad_mem, OFF_GPIO_EXTIPSELL, 0x22222222);
+	hal_write(sim_gamepad_mem, OFF_GPIO_EXTIFALL, 0xff);
+	hal_write(sim_gamepad_mem, OFF_GPIO_EXTIRISE, 0xff);
+	hal_write(sim_gamepad_mem, OFF_GPIO_IEN, 0xff);
+	gamepad_core_init(&sim_gamepad, hal_read(sim_gamepad_mem, OFF_GPIO_PC_DIN));
+	memset(&sim_gamepad_page, 0, sizeof(sim_gamepad_page));
+	sim_gamepad_page.state = sim_gamepad.input;
+
+	/* Set up tone playback like dac_probe */
+	sim_dac_mem = hal_map(DAC0_BASE2, 0x100);
+	sim_timer_mem = hal_map(TIMER1_BASE, 0x100);
+	dac_init_wavetables();
+	dac_init_notes();
+	memset(&sim_synth, 0, sizeof(sim_synth));
+	memset(&sim_seq, 0, sizeof(sim_seq));
+	memset(&sim_render, 0, sizeof(sim_render));
+	for (i = 0; i < DAC_VOICES; i++) {
+		sim_synth.voices[i].wavetable = dac_wavetables[DAC_WAVE_SQUARE];
+		sim_synth.voices[i].volume = 5;
+	}
+	hal_write(sim_dac_mem, OFF_DAC0_CH0CTRL, 1);
+	hal_write(sim_dac_mem, OFF_DAC0_CH1CTRL, 1);
+	hal_write(sim_timer_mem, OFF_TIMER_IEN, 1);
+	hal_write(sim_timer_mem, OFF_TIMER_CMD, 0b1);
+}
+
+/* Update the shared page after the debouncer changed the input */
+static bool sim_gamepad_publish(uint8_t prev, uint64_t time) {
+	if (sim_gamepad.input == prev) return false;
+
+	gamepad_core_page_update(&sim_gamepad_page, prev, sim_gamepad.input, time);
+
+	return true;
+}
+
+bool sim_gamepad_irq(uint64_t now) {
+	uint8_t prev = sim_gamepad.input;
+	uint8_t din, flags;
+
+	gamepad_core_latch(sim_gamepad_mem, &din, &flags);
+	if (gamepad_core_rate(&sim_gamepad, din, flags, now)) {
+		hal_write(sim_gamepad_mem, OFF_GPIO_IEN, 0x0);
+	}
+	gamepad_core_sample(&sim_gamepad, din, flags, now);
+
+	return sim_gamepad_publish(prev, now);
+}
+
+bool sim_gamepad_poll(uint64_t now) {
+	uint8_t prev = sim_gamepad.input;
+	uint8_t din = hal_read(sim_gamepad_mem, OFF_GPIO_PC_DIN);
+
+	if (gamepad_core_poll(&sim_gamepad, din, now)) {
+		hal_write(sim_gamepad_mem, OFF_GPIO_IFC, 0xff);
+		hal_write(sim_gamepad_mem, OFF_GPIO_IEN, 0xff);
+		din = hal_read(sim_gamepad_mem, OFF_GPIO_PC_DIN);
+	}
+	gamepad_core_sample(&sim_gamepad, din, 0, now);
+
+	return sim_gamepad_publish(prev, now);
+}
+
+bool sim_gamepad_timer(uint64_t now) {
+	uint8_t prev = sim_gamepad.input;
+
+	gamepad_core_expire(&sim_gamepad, now);
+
+	return sim_gamepad_publish(prev, now);
+}
+
+void sim_gamepad_set_debounce(uint32_t window_ns) {
+	sim_gamepad.window_ns = window_ns;
+}
+
+void sim_gamepad_set_leading(bool leading) {
+	sim_gamepad.leading = leading;
+}
+
+void sim_gamepad_set_poll_rate(uint32_t rate) {
+	sim_gamepad.poll_rate = rate;
+}
+
+void sim_dac_timer_irq(void) {
+	/* Render the next block once the last one has played, like the renderer thread */
+	if (sim_render.tail == sim_render.head) {
+		dac_core_render_block(&sim_seq, &sim_synth, sim_render.frames, DAC_RENDER_BLOCK - 1,
+				sim_render.head, DAC_RENDER_BLOCK);
+		sim_render.head += DAC_RENDER_BLOCK;
+	}
+
+	hal_write(sim_timer_mem, OFF_TIMER_IFC, 1);
+	hal_write(sim_dac_mem, OFF_DAC0_COMBDATA, sim_render.frames[sim_render.tail++ & (DAC_RENDER_BLOCK - 1)]);
+}
+
+int sim_dac_commands(const struct dac_cmd *cmds, unsigned int count) {
+	unsigned int i;
+	int result;
+
+	for (i = 0; i < count; i++) {
+		result = dac_cmd_check(&cmds[i]);
+		if (result != 0) return result;
+	}
+	for (i = 0; i < count; i++) {
+		dac_cmd_apply(&sim_synth, &cmds[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Host build of the driver core, running against the simulated registers.
+ * Each function does what the matching kernel path does, without the
+ * scheduling around it.
+ */
+
+#ifndef SIM_DRIVER_H
+#define SIM_DRIVER_H
+
+#include "gamepad-core.h"
+#include "dac-core.h"
+
+/* Driver state, can be used directly with the core functions */
+extern struct gamepad_core sim_gamepad;
+extern struct gamepad_shared sim_gamepad_page;
+extern struct dac_synth sim_synth;
+extern struct dac_seq sim_seq;
+
+/* Reset the registers and probe both devices, all buttons released */
+void sim_driver_probe(void);
+
+/* Gamepad interrupt and tasklet for a pin change at time now, returns true if input changed */
+bool sim_gamepad_irq(uint64_t now);
+
+/* Debounce timer at time now, returns true if input changed */
+bool sim_gamepad_timer(uint64_t now);
+
+/* Sampling timer while sim_gamepad.polling, returns true if input changed */
+bool sim_gamepad_poll(uint64_t now);
+
+/* Set the debounce window, 0 disables it */
+void sim_gamepad_set_debounce(uint32_t window_ns);
+
+/* Deliver the first edge at once instead of the settled level */
+void sim_gamepad_set_leading(bool leading);
+
+/* Set the edge rate that starts polling, 0 disables it */
+void sim_gamepad_set_poll_rate(uint32_t rate);
+
+/* DAC timer interrupt, plays one tone sample, rendering a block of DAC_RENDER_BLOCK first when needed */
+void sim_dac_timer_irq(void);
+
+/* Apply a checked command batch, returns 0 or a negative error code */
+int sim_dac_commands(const struct dac_cmd *cmds, unsigned int count);
+
+#endif // SIM_DRIVER_H
@@ -0,0 +1,32 @@
+/*
+ * Kernel helpers used by the driver core, for host builds.
+ */
+
+#ifndef KCOMPAT_H
+#define KCOMPAT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+
+#define smp_mb() __sync_synchronize()
+#define smp_rmb() __sync_synchronize()
+#define smp_wmb() __sync_synchronize()
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+
+#define __ffs(x) __builtin_ctz(x)
+#define fls(x) ((x) ? 32 - __builtin_clz(x) : 0)
+#define hweight8(x) __builtin_popcount((uint8_t)(x))
+
+static inline uint64_t div_u64(uint64_t dividend, uint32_t divisor) {
+	return dividend / divisor;
+}
+
+#endif // KCOMPAT_H
@@ -0,0 +1,146 @@
+/*
+ * Simulated EFM32GG register file.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+#include "offsets.h"
+#include "efm32gg.h"
+
+/* Register block at a physical address */
+struct sim_block {
+	unsigned long phys;
+	unsigned long size;
+	uint32_t regs[0x1200 / 4];
+};
+
+static struct sim_block sim_gpio = { .phys = GPIO_PA_BASE, .size = 0x200 };
+static struct sim_block sim_dac = { .phys = DAC0_BASE2, .size = 0x100 };
+static struct sim_block sim_timer = { .phys = TIMER1_BASE, .size = 0x100 };
+static struct sim_block sim_cmu = { .phys = CMU_BASE2, .size = 0x100 };
+static struct sim_block sim_dma = { .phys = DMA_BASE, .size = 0x1200 };
+static struct sim_block sim_prs = { .phys = PRS_BASE, .size = 0x100 };
+static struct sim_block sim_dwt = { .phys = DWT_BASE, .size = 0x10 };
+static struct sim_block sim_demcr = { .phys = DEMCR_BASE, .size = 0x4 };
+
+static struct sim_block *sim_blocks[] = {
+	&sim_gpio, &sim_dac, &sim_timer, &sim_cmu, &sim_dma, &sim_prs, &sim_dwt, &sim_demcr
+};
+
+#define SIM_BLOCK_COUNT (sizeof(sim_blocks) / sizeof(sim_blocks[0]))
+
+/* TIMER1 has been started */
+static bool sim_timer_running;
+
+/* Samples written to COMBDATA, the oldest are overwritten */
+#define SIM_DAC_SAMPLES 65536 // Must be a power of two
+
+static struct {
+	uint32_t values[SIM_DAC_SAMPLES];
+	unsigned int head;
+	unsigned int tail;
+} sim_dac_out;
+
+/* Find the block a mapping points into */
+static struct sim_block *sim_block(void *mem) {
+	unsigned int i;
+
+	for (i = 0; i < SIM_BLOCK_COUNT; i++) {
+		if (mem == (void *)sim_blocks[i]->regs) return sim_blocks[i];
+	}
+
+	return NULL;
+}
+
+/* Register word at an offset */
+#define REG(block, off) ((block)->regs[(off) / 4])
+
+void *sim_map(unsigned long phys, unsigned long size) {
+	unsigned int i;
+
+	for (i = 0; i < SIM_BLOCK_COUNT; i++) {
+		if (phys == sim_blocks[i]->phys && size <= sim_blocks[i]->size) return sim_blocks[i]->regs;
+	}
+
+	return NULL;
+}
+
+uint32_t sim_read(void *mem, uint32_t off) {
+	struct sim_block *block = sim_block(mem);
+
+	if (block == NULL || off >= block->size) return 0;
+
+	return REG(block, off);
+}
+
+void sim_write(void *mem, uint32_t off, uint32_t value) {
+	struct sim_block *block = sim_block(mem);
+
+	if (block == NULL || off >= block->size) return;
+
+	if (block == &sim_gpio && off == OFF_GPIO_IFC) {
+		REG(block, OFF_GPIO_IF) &= ~value;
+	} else if (block == &sim_timer && off == OFF_TIMER_IFC) {
+		REG(block, OFF_TIMER_IF) &= ~value;
+	} else if (block == &sim_timer && off == OFF_TIMER_CMD) {
+		if (value & 0b10) sim_timer_running = false;
+		if (value & 0b01) sim_timer_running = true;
+	} else if (block == &sim_dac && off == OFF_DAC0_COMBDATA) {
+		REG(block, off) = value;
+		sim_dac_out.values[sim_dac_out.head++ & (SIM_DAC_SAMPLES - 1)] = value;
+		if (sim_dac_out.head - sim_dac_out.tail > SIM_DAC_SAMPLES) {
+			sim_dac_out.tail = sim_dac_out.head - SIM_DAC_SAMPLES;
+		}
+	} else {
+		REG(block, off) = value;
+	}
+}
+
+void sim_reset(void) {
+	unsigned int i;
+
+	for (i = 0; i < SIM_BLOCK_COUNT; i++) {
+		memset(sim_blocks[i]->regs, 0, sizeof(sim_blocks[i]->regs));
+	}
+	sim_dac_out.head = 0;
+	sim_dac_out.tail = 0;
+	sim_timer_running = false;
+}
+
+bool sim_gpio_set(uint8_t din) {
+	uint8_t prev = REG(&sim_gpio, OFF_GPIO_PC_DIN);
+	uint8_t rising = ~prev & din;
+	uint8_t falling = prev & ~din;
+
+	/* Pins 0-7 are routed to the external interrupts, see EXTIPSELL */
+	REG(&sim_gpio, OFF_GPIO_PC_DIN) = din;
+	REG(&sim_gpio, OFF_GPIO_IF) |= (rising & REG(&sim_gpio, OFF_GPIO_EXTIRISE)) |
+			(falling & REG(&sim_gpio, OFF_GPIO_EXTIFALL));
+
+	return sim_gpio_irq_pending();
+}
+
+bool sim_gpio_irq_pending(void) {
+	return (REG(&sim_gpio, OFF_GPIO_IF) & REG(&sim_gpio, OFF_GPIO_IEN)) != 0;
+}
+
+bool sim_timer_tick(void) {
+	if (sim_timer_running) REG(&sim_timer, OFF_TIMER_IF) |= 1;
+
+	return sim_timer_irq_pending();
+}
+
+bool sim_timer_irq_pending(void) {
+	return (REG(&sim_timer, OFF_TIMER_IF) & REG(&sim_timer, OFF_TIMER_IEN)) != 0;
+}
+
+unsigned int sim_dac_samples(uint32_t *buff, unsigned int max) {
+	unsigned int num = 0;
+
+	while (num < max && sim_dac_out.tail != sim_dac_out.head) {
+		buff[num++] = sim_dac_out.values[sim_dac_out.tail++ & (SIM_DAC_SAMPLES - 1)];
+	}
+
+	return num;
+}
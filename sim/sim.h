@@ -0,0 +1,36 @@
+/*
+ * Simulated EFM32GG register file for host builds of the driver core. The
+ * GPIO, DAC and TIMER1 blocks model the behaviour the driver relies on, the
+ * other blocks are plain memory.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Register access used by hal.h */
+void *sim_map(unsigned long phys, unsigned long size);
+uint32_t sim_read(void *mem, uint32_t off);
+void sim_write(void *mem, uint32_t off, uint32_t value);
+
+/* Clear all registers and recorded samples */
+void sim_reset(void);
+
+/* Drive the pins of port C, returns true if the GPIO interrupt is pending */
+bool sim_gpio_set(uint8_t din);
+
+/* Check if the GPIO interrupt is pending */
+bool sim_gpio_irq_pending(void);
+
+/* Let TIMER1 wrap once, returns true if its interrupt is pending */
+bool sim_timer_tick(void);
+
+/* Check if the TIMER1 interrupt is pending */
+bool sim_timer_irq_pending(void);
+
+/* Take the values written to DAC0 COMBDATA since the last call, returns the number copied */
+unsigned int sim_dac_samples(uint32_t *buff, unsigned int max);
+
+#endif // SIM_H
@@ -0,0 +1,240 @@
+/*
+ * Core tests. Drives the host build of the driver through the simulated
+ * registers and checks the behaviour programs rely on:
+ *
+ *   debounce  only settled levels are delivered, glitches are dropped, and
+ *             leading-edge mode delivers the first edge at once
+ *   ring      a reader that falls behind loses the oldest events, the first
+ *             record after the gap is flagged and the sequence numbers show it
+ *   commands  a batch is checked as a whole and takes effect on one sample
+ *   sequencer a score loops back to its loop event and a score without a loop
+ *             ends in silence
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "driver.h"
+
+#define MS 1000000ULL // Nanoseconds in a millisecond
+
+/* Square wave samples of the DAC for a peak-to-peak level of 1024 */
+#define SQUARE_HIGH 2559
+#define SQUARE_LOW 1536
+
+static unsigned int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* Change the pins at time now and run the interrupt, returns true if input changed */
+static bool press(uint8_t din, uint64_t now) {
+	sim_gpio_set(din);
+	return sim_gamepad_irq(now);
+}
+
+/* Play num samples through the DAC timer interrupt and collect them */
+static void play(uint32_t *samples, unsigned int num) {
+	unsigned int i;
+
+	for (i = 0; i < num; i++) sim_dac_timer_irq();
+	CHECK(sim_dac_samples(samples, num) == num);
+	for (i = 0; i < num; i++) samples[i] &= 0xfff; // Both channels carry the same sample
+}
+
+static void test_debounce(void) {
+	sim_driver_probe();
+
+	/* A bouncing press is delivered once the pin has settled for the window */
+	CHECK(!press(0xfe, 0));
+	CHECK(!press(0xff, 1 * MS));
+	CHECK(!press(0xfe, 2 * MS));
+	CHECK(!sim_gamepad_timer(6 * MS));
+	CHECK(sim_gamepad.input == 0xff);
+	CHECK(sim_gamepad_timer(7 * MS));
+	CHECK(sim_gamepad.input == 0xfe);
+	CHECK(sim_gamepad.head == 1);
+	CHECK(sim_gamepad.events[0].seq == 0);
+	CHECK(sim_gamepad.events[0].prev == 0xff && sim_gamepad.events[0].state == 0xfe);
+	CHECK(sim_gamepad.events[0].time == 7 * MS);
+	CHECK(sim_gamepad_page.state == 0xfe && sim_gamepad_page.presses[0] == 1);
+
+	/* A glitch shorter than the window is never seen */
+	CHECK(!press(0xff, 20 * MS));
+	CHECK(!press(0xfe, 20 * MS + MS / 2));
+	CHECK(!sim_gamepad_timer(30 * MS));
+	CHECK(sim_gamepad.input == 0xfe);
+	CHECK(sim_gamepad.head == 1);
+
+	/* Leading-edge mode delivers the first edge and ignores the bounces */
+	sim_gamepad_set_leading(true);
+	CHECK(press(0xff, 40 * MS));
+	CHECK(sim_gamepad.input == 0xff);
+	CHECK(!press(0xfe, 41 * MS));
+	CHECK(!press(0xff, 42 * MS));
+	CHECK(!sim_gamepad_timer(45 * MS));
+	CHECK(sim_gamepad.input == 0xff);
+	CHECK(sim_gamepad.head == 2);
+}
+
+static void test_ring(void) {
+	struct gamepad_event buff[GAMEPAD_RING_SIZE];
+	struct gamepad_cursor cursor;
+	const unsigned int changes = GAMEPAD_RING_SIZE + 10;
+	unsigned int i, num, first;
+	uint32_t lost;
+
+	sim_driver_probe();
+	sim_gamepad_set_debounce(0);
+	sim_gamepad_set_poll_rate(0);
+	gamepad_cursor_init(&sim_gamepad, &cursor);
+
+	for (i = 0; i < changes; i++) {
+		CHECK(press(i % 2 == 0 ? 0xfe : 0xff, (i + 1) * MS));
+	}
+
+	/* Only the records behind head are valid, the oldest ones were overwritten */
+	num = gamepad_cursor_snapshot(&sim_gamepad, &cursor, buff, GAMEPAD_RING_SIZE, &first, &lost);
+	CHECK(num == GAMEPAD_RING_SIZE - 1);
+	CHECK(lost == changes - num);
+	CHECK(cursor.dropped == lost);
+	if (num != GAMEPAD_RING_SIZE - 1) return;
+
+	/* The gap shows in the sequence numbers and the first record is flagged */
+	CHECK(buff[first].seq == lost);
+	CHECK(buff[first].flags & GAMEPAD_EVENT_OVERFLOW);
+	for (i = 1; i < num; i++) {
+		CHECK(buff[first + i].seq == buff[first + i - 1].seq + 1);
+		CHECK(!(buff[first + i].flags & GAMEPAD_EVENT_OVERFLOW));
+		CHECK(buff[first + i].prev == buff[first + i - 1].state);
+	}
+	cursor.tail += num;
+
+	/* A reader that keeps up sees no gap */
+	CHECK(press(0xfe, (changes + 1) * MS));
+	num = gamepad_cursor_snapshot(&sim_gamepad, &cursor, buff, GAMEPAD_RING_SIZE, &first, &lost);
+	CHECK(num == 1 && lost == 0);
+	CHECK(buff[first].seq == changes && buff[first].flags == 0);
+}
+
+static void test_commands(void) {
+	const struct dac_cmd batch[] = {
+		{ DAC_CMD_SET_WAVEFORM, 0, 0, DAC_WAVE_SQUARE },
+		{ DAC_CMD_SET_AMPLITUDE, 0, 0, 1024 },
+		{ DAC_CMD_SET_FREQ, 0, 0, 1000000 },
+		{ DAC_CMD_SET_WAVEFORM, 1, 0, DAC_WAVE_SQUARE },
+		{ DAC_CMD_SET_AMPLITUDE, 1, 0, 1024 },
+		{ DAC_CMD_SET_FREQ, 1, 0, 500000 },
+	};
+	const struct dac_cmd invalid[] = {
+		{ DAC_CMD_STOP, 0, 0, 0 },
+		{ DAC_CMD_STOP, DAC_VOICES, 0, 0 },
+	};
+	uint32_t samples[2 * DAC_RENDER_BLOCK];
+	unsigned int i;
+
+	sim_driver_probe();
+
+	/* Silence until the batch is applied */
+	play(samples, DAC_RENDER_BLOCK);
+	for (i = 0; i < DAC_RENDER_BLOCK; i++) CHECK(samples[i] == DAC_MIDPOINT);
+
+	/* Both voices start on the same sample, a sample with only one of them would be half as loud */
+	CHECK(sim_dac_commands(batch, sizeof(batch) / sizeof(batch[0])) == 0);
+	play(samples, DAC_RENDER_BLOCK);
+	CHECK(samples[0] == DAC_MIDPOINT + 1023);
+	for (i = 0; i < DAC_RENDER_BLOCK; i++) {
+		CHECK(samples[i] == DAC_MIDPOINT + 1023 || samples[i] == DAC_MIDPOINT - 1 ||
+				samples[i] == DAC_MIDPOINT - 1024);
+	}
+
+	/* A batch with a bad command is refused before any of it is applied */
+	CHECK(sim_dac_commands(invalid, sizeof(invalid) / sizeof(invalid[0])) == -EINVAL);
+	CHECK(sim_synth.active == 0x3);
+
+	/* Stopping one voice leaves the other one playing on its own */
+	CHECK(sim_dac_commands(invalid, 1) == 0);
+	play(samples, 2 * DAC_RENDER_BLOCK);
+	for (i = 0; i < 2 * DAC_RENDER_BLOCK; i++) {
+		CHECK(samples[i] == SQUARE_HIGH || samples[i] == SQUARE_LOW);
+	}
+}
+
+static void test_sequencer(void) {
+	/* A note that plays for 10 samples and a rest of 25, looping back to the note */
+	struct dac_seq_event score[] = {
+		{ 0, 0, 0, 0, DAC_WAVE_SQUARE },
+		{ 5, 0, 69, 64, DAC_WAVE_SQUARE },
+		{ 10, 0, 0, 0, DAC_WAVE_SQUARE },
+		{ 20, 0, 0, 0, DAC_WAVE_SQUARE },
+	};
+	struct dac_seq_event once[] = {
+		{ 0, 0, 69, 64, DAC_WAVE_SQUARE },
+		{ 10, 0, 0, 0, DAC_WAVE_SQUARE },
+	};
+	struct dac_seq_event spin[] = {
+		{ 0, 0, 60, 64, DAC_WAVE_SQUARE },
+		{ 0, 1, 64, 64, DAC_WAVE_SQUARE },
+	};
+	uint32_t samples[4 * DAC_RENDER_BLOCK];
+	unsigned int i, start = 0, starts = 0;
+	bool sound, was = false;
+
+	sim_driver_probe();
+	CHECK(dac_seq_check(score, 4) == 0);
+	dac_seq_swap(&sim_seq, score, 4, 1);
+
+	/* The note starts every 35 samples after the first 5 */
+	play(samples, 4 * DAC_RENDER_BLOCK);
+	for (i = 0; i < 4 * DAC_RENDER_BLOCK; i++) {
+		sound = samples[i] != DAC_MIDPOINT;
+		if (sound && !was) {
+			if (starts == 0) CHECK(i == 5);
+			if (starts > 0) CHECK(i - start == 35);
+			start = i;
+			starts++;
+		}
+		was = sound;
+	}
+	CHECK(starts == (4 * DAC_RENDER_BLOCK - 5 + 34) / 35);
+	CHECK(sim_seq.playing);
+	CHECK(sim_seq.loops == starts - 1);
+	CHECK(sim_seq.samples == 4 * DAC_RENDER_BLOCK);
+
+	/* Without a loop the score ends in silence */
+	dac_seq_swap(&sim_seq, once, 2, DAC_SEQ_NO_LOOP);
+	play(samples, DAC_RENDER_BLOCK);
+	CHECK(samples[0] != DAC_MIDPOINT);
+	for (i = 10; i < DAC_RENDER_BLOCK; i++) CHECK(samples[i] == DAC_MIDPOINT);
+	CHECK(!sim_seq.playing);
+	CHECK(sim_seq.loops == 0);
+
+	/* A loop without delays is spread over samples instead of spinning */
+	dac_seq_swap(&sim_seq, spin, 2, 0);
+	play(samples, DAC_RENDER_BLOCK);
+	CHECK(sim_seq.playing);
+	CHECK(sim_seq.loops == DAC_RENDER_BLOCK * DAC_SEQ_EVENTS_PER_SAMPLE / 2);
+	CHECK(sim_synth.active == 0x3);
+}
+
+int main(void) {
+	test_debounce();
+	test_ring();
+	test_commands();
+	test_sequencer();
+
+	if (failures != 0) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+
+	return 0;
+}